@@ -0,0 +1,93 @@
+/* Hosted micro-benchmarks ("make bench"). kernel.c is compiled into this file with HOSTED defined
+ * and runs on the port stubs in hosted.c. Every figure is the median of BENCH_RUNS timed runs of a
+ * fixed amount of work, so results from two builds on the same machine can be compared directly. */
+#include <stdio.h>
+#include <time.h>
+#include "kernel.c"
+
+#define BENCH_RUNS 9
+extern const uint32_t hosted_ram_size; // hosted.c
+typedef void (*BenchFn)(int iters);
+
+double now_ns() { struct timespec t; clock_gettime(CLOCK_MONOTONIC, &t); return t.tv_sec * 1e9 + t.tv_nsec; }
+double bench(BenchFn fn, int iters) { // median nanoseconds per iteration
+    double r[BENCH_RUNS]; fn(iters / 8 + 1); // warm caches and the glyph/line state first
+    for (int i = 0; i < BENCH_RUNS; i++) { double t = now_ns(); fn(iters); r[i] = (now_ns() - t) / iters; }
+    for (int i = 1; i < BENCH_RUNS; i++) for (int j = i; j > 0 && r[j] < r[j - 1]; j--) { double t = r[j]; r[j] = r[j - 1]; r[j - 1] = t; }
+    return r[BENCH_RUNS / 2];
+}
+void report(const char* group, const char* name, double ns, const char* rate_unit, double rate) {
+    printf("%-8s %-28s %12.2f us %14.1f %s\n", group, name, ns / 1000, rate, rate_unit);
+}
+
+void layout(int n) { // the first n windows open, the last one focused
+    for (int i = 0; i < WIN_COUNT; i++) windows[i]->visible = i < n;
+    for (int i = 0; i < n; i++) wm_raise(windows[i]);
+    start_open = false; render();
+}
+void frame_full(int iters) { for (int i = 0; i < iters; i++) { damage_all(); render(); } }
+void frame_cursor(int iters) { for (int i = 0; i < iters; i++) { mouse_apply((i & 1) ? 1 : -1, 0, 0); render(); } }
+void frame_notepad(int iters) { for (int i = 0; i < iters; i++) { damage_window(&win_notepad); render(); } }
+void type_notepad(int iters) { for (int i = 0; i < iters; i++) { handle_key((i & 1) ? '\b' : 'x', (i & 1) ? 0x0E : 0x2D); render(); } }
+
+uint8_t file_data[64 * 1024];
+void fs_save_64k(int iters) { for (int i = 0; i < iters; i++) { file_data[0] = i; fs_save(0, "bench.txt", file_data, sizeof(file_data), FS_TEXT); } }
+void fs_load_64k(int iters) { for (int i = 0; i < iters; i++) fs_load_txt(fs_lookup(0, "bench.txt")); }
+void fs_small_files(int iters) { // 256 names in one directory: exercises the name hash and small writes
+    char name[16] = "f";
+    for (int i = 0; i < iters; i++) { fmt_uint(name + 1, i & 255); fs_save(0, name, file_data, 512, FS_TEXT); }
+}
+
+void click_calc(int iters) { // alternating "7" and "C": WM hit test, message dispatch, calculator logic and damage
+    for (int i = 0; i < iters; i++) { int row = (i & 1) ? 3 : 0; handle_click(win_calc.x + 3, win_calc.y + 5 + row * 2); dirty_count = 0; }
+}
+void click_desktop(int iters) { for (int i = 0; i < iters; i++) { handle_click(SCREEN_W - 2, SCREEN_H - 3); dirty_count = 0; } }
+
+// Steers along a Hamiltonian cycle of the playfield (even height): column 0 leads back up, rows snake across the rest.
+void snake_autopilot() {
+    int head = snake_head(), x = head % snake_w, y = head / snake_w;
+    if (x == 0) snake_dir = y == 0 ? 1 : 0;
+    else if (!(y & 1)) snake_dir = x < snake_w - 1 ? 1 : 2;
+    else snake_dir = x > 1 || y == snake_h - 1 ? 3 : 2;
+}
+void snake_ticks(int iters) { for (int i = 0; i < iters; i++) { snake_autopilot(); update_snake(); render(); } }
+void snake_grow(int len) { while (snake_len < len && !game_over) { snake_autopilot(); update_snake(); dirty_count = 0; } }
+
+void fill_notepad(uint32_t bytes) {
+    np_clear();
+    for (uint32_t i = 0; i < bytes; i++) np_insert(i % 61 == 60 ? '\n' : 'a' + i % 26);
+    np_goto(np_line_count() / 2, 10); np_top = np_cur_line(); // cursor and view in the middle of the document
+}
+
+int main() {
+    MultibootInfo mb = { .flags = 1, .mem_upper = hosted_ram_size / 1024 };
+    pmm_base = (uintptr_t)kernel_end - 0x100000;
+    pmm_init(MULTIBOOT_MAGIC, &mb);
+    gfx_init(); np_init(); paint_new(IMG_LEGACY_W, IMG_LEGACY_H); fs_init();
+    current_state = STATE_DESKTOP; mouse_x = SCREEN_W / 2; mouse_y = SCREEN_H / 2;
+    printf("%-8s %-28s %15s %14s\n", "group", "benchmark", "median", "rate");
+
+    const char* layouts[] = { "desktop only", "1 window", "3 windows", "all 6 windows" }; int counts[] = { 0, 1, 3, WIN_COUNT };
+    for (int l = 0; l < 4; l++) { layout(counts[l]); double ns = bench(frame_full, 2000); report("frame", layouts[l], ns, "fps", 1e9 / ns); }
+    layout(WIN_COUNT); { double ns = bench(frame_cursor, 20000); report("frame", "cursor move, 6 windows", ns, "fps", 1e9 / ns); }
+
+    layout(0); win_notepad.visible = true; wm_raise(&win_notepad); render();
+    uint32_t sizes[] = { 1024, 64 * 1024, 1024 * 1024 }; const char* size_names[] = { "notepad render 1 KiB", "notepad render 64 KiB", "notepad render 1 MiB" };
+    for (int s = 0; s < 3; s++) { fill_notepad(sizes[s]); double ns = bench(frame_notepad, 5000); report("notepad", size_names[s], ns, "fps", 1e9 / ns); }
+    { double ns = bench(type_notepad, 20000); report("notepad", "keystroke + render, 1 MiB", ns, "keys/s", 1e9 / ns); }
+
+    for (uint32_t i = 0; i < sizeof(file_data); i++) file_data[i] = i % 61 == 60 ? '\n' : 'a' + i % 26;
+    { double ns = bench(fs_save_64k, 500); report("fs", "save 64 KiB", ns, "MiB/s", sizeof(file_data) / ns * 1e9 / (1 << 20)); }
+    { double ns = bench(fs_load_64k, 500); report("fs", "load 64 KiB into notepad", ns, "MiB/s", sizeof(file_data) / ns * 1e9 / (1 << 20)); }
+    { double ns = bench(fs_small_files, 2560); report("fs", "save 512 B file, 256 names", ns, "files/s", 1e9 / ns); }
+
+    layout(0); win_snake.visible = true; win_snake.x = 0; win_snake.y = 0; win_snake.w = 60; win_snake.h = 24; wm_raise(&win_snake); reset_snake(); snake_food = -1; render(); // 58 x 20 playfield, no food so the length stays put
+    { double ns = bench(snake_ticks, 20000); report("snake", "tick + render, length 3", ns, "ticks/s", 1e9 / ns); }
+    snake_food = snake_place_food(); snake_grow(1000); snake_food = -1; render(); { double ns = bench(snake_ticks, 20000); report("snake", "tick + render, length 1000", ns, "ticks/s", 1e9 / ns); }
+    win_snake.x = 25; win_snake.y = 5; win_snake.w = 30; win_snake.h = 15;
+
+    layout(WIN_COUNT); wm_raise(&win_calc); render();
+    { double ns = bench(click_calc, 100000); report("click", "calculator button", ns, "clicks/s", 1e9 / ns); }
+    { double ns = bench(click_desktop, 100000); report("click", "desktop (no hit)", ns, "clicks/s", 1e9 / ns); }
+    return 0;
+}
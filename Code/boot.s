@@ -16,13 +16,160 @@ stack_bottom:
 resb 16384 ; 16 KiB
 stack_top:
 
+section .data
+align 8
+gdt:
+    dq 0x0000000000000000 ; null
+    dq 0x00CF9A000000FFFF ; 0x08: ring 0 code, flat 4 GiB
+    dq 0x00CF92000000FFFF ; 0x10: ring 0 data, flat 4 GiB
+gdt_end:
+gdt_ptr:
+    dw gdt_end - gdt - 1
+    dd gdt
+
 section .text
 global _start:function (_start.end - _start)
 _start:
     mov esp, stack_top
+    ; The multiboot GDT is not guaranteed to stay valid, load our own so the IDT can use selector 0x08
+    lgdt [gdt_ptr]
+    jmp 0x08:.reload_cs
+.reload_cs:
+    mov ax, 0x10
+    mov ds, ax
+    mov es, ax
+    mov fs, ax
+    mov gs, ax
+    mov ss, ax
+    ; kernel_main(magic, multiboot_info): the loader leaves them in eax / ebx, which survive the reload above
+    push ebx
+    push eax
     extern kernel_main
     call kernel_main
     cli
 .hang: hlt
     jmp .hang
-.end:
\ No newline at end of file
+.end:
+
+; --- IRQ STUBS ---
+; Each stub pushes its IRQ number and funnels into irq_common, which saves the
+; general registers and calls irq_handler(irq) in kernel.c.
+extern irq_handler
+%macro IRQ 1
+irq%1_stub:
+    push dword %1
+    jmp irq_common
+%endmacro
+IRQ 0
+IRQ 1
+IRQ 2
+IRQ 3
+IRQ 4
+IRQ 5
+IRQ 6
+IRQ 7
+IRQ 8
+IRQ 9
+IRQ 10
+IRQ 11
+IRQ 12
+IRQ 13
+IRQ 14
+IRQ 15
+
+irq_common:
+    pushad
+    cld
+    push dword [esp + 32] ; irq number pushed by the stub
+    call irq_handler
+    add esp, 4
+    popad
+    add esp, 4
+    iretd
+
+; --- CONTEXT SWITCH ---
+; switch_context(uint32_t* save_esp, uint32_t load_esp): saves the callee-saved registers on the
+; current stack, stores esp, then resumes the other task from its own stack. A new task's stack
+; is prepared by task_create() to pop four zeroes and return into task_start.
+global switch_context
+switch_context:
+    mov eax, [esp + 4]
+    mov edx, [esp + 8]
+    push ebp
+    push ebx
+    push esi
+    push edi
+    mov [eax], esp
+    mov esp, edx
+    pop edi
+    pop esi
+    pop ebx
+    pop ebp
+    ret
+
+; --- APIC VECTORS ---
+; The wake-up IPI only has to end an application processor's hlt; the spurious vector needs no EOI.
+extern lapic
+global ipi_wake_stub, apic_spurious_stub
+ipi_wake_stub:
+    push eax
+    mov eax, [lapic]
+    mov dword [eax + 0xB0], 0 ; local APIC EOI
+    pop eax
+    iretd
+apic_spurious_stub:
+    iretd
+
+; --- APPLICATION PROCESSOR ENTRY ---
+; smp_start() copies ap_trampoline..ap_trampoline_end to AP_TRAMPOLINE (0x8000) and sends the SIPI.
+; The AP starts there in real mode with cs = 0x800, loads the GDT above, enters protected mode,
+; takes the next slot of ap_stacks and calls ap_main(slot) in kernel.c.
+AP_TRAMPOLINE equ 0x8000
+extern ap_main, ap_stacks, ap_next
+global ap_trampoline, ap_trampoline_end
+bits 16
+ap_trampoline:
+    cli
+    cld
+    xor ax, ax
+    mov ds, ax
+    o32 lgdt [AP_TRAMPOLINE + (ap_gdt_ptr - ap_trampoline)]
+    mov eax, cr0
+    or al, 1
+    mov cr0, eax
+    jmp dword 0x08:ap_start32
+align 4
+ap_gdt_ptr:
+    dw gdt_end - gdt - 1
+    dd gdt
+ap_trampoline_end:
+bits 32
+ap_start32:
+    mov ax, 0x10
+    mov ds, ax
+    mov es, ax
+    mov fs, ax
+    mov gs, ax
+    mov ss, ax
+    mov eax, 1
+    lock xadd [ap_next], eax
+    mov esp, [ap_stacks + eax * 4]
+    push eax
+    call ap_main
+    cli
+.hang: hlt
+    jmp .hang
+
+; Empty section the linker places after .bss, so its address marks the end of the kernel image
+section .kend nobits alloc write align=4096
+global kernel_end
+kernel_end:
+
+section .rodata
+global irq_stub_table
+irq_stub_table:
+%assign i 0
+%rep 16
+    dd irq%[i]_stub
+%assign i i+1
+%endrep
@@ -0,0 +1,89 @@
+/* File system persistence on an emulated disk ("make disktest"). kernel.c is compiled in with
+ * HOSTED defined and hosted.c plays the primary-master ATA disk, so the probe, buffer cache, mount
+ * and sync paths run as they do under QEMU. Each "boot" wipes everything the kernel keeps in RAM
+ * and mounts the disk again. Every check prints one line; any failure fails the run. */
+#include <stdio.h>
+#include "kernel.c"
+
+extern const uint32_t hosted_ram_size; // hosted.c
+extern uint8_t* hosted_disk; extern uint32_t hosted_disk_sectors, hosted_disk_writes;
+extern int hosted_disk_fail_reads, hosted_disk_fail_writes;
+
+#define DISK_SECTORS 40000 // ~20 MiB: less than the store hosted RAM allows, so a blank disk bounds it
+uint8_t disk[DISK_SECTORS * 512];
+uint8_t data[3000], big[2000000];
+int failures = 0;
+
+void expect(const char* what, bool ok) { printf("%-58s %s\n", what, ok ? "ok" : "FAILED"); failures += !ok; }
+bool boot() { // RAM is gone, the disk stays
+    memset(bcache, 0, sizeof(bcache)); memset(bcache_hash, 0, sizeof(bcache_hash)); bcache_init();
+    fs_persistent = fs_super_dirty = false; fs_dirty_count = 0; memset(fs_node_dirty, 0, sizeof(fs_node_dirty));
+    fs_init(); ata_init(); return fs_mount();
+}
+void name_of(char* name, char c, int i) { name[0] = c; fmt_uint(name + 1, i); }
+void make(const char* name, int seed, uint32_t len) { for (uint32_t i = 0; i < len; i++) data[i] = i * seed; fs_save(0, name, data, len, FS_TEXT); }
+bool holds(const char* name, int seed, uint32_t len) {
+    int n = fs_lookup(0, name); if (n < 0) return false;
+    uint32_t got; const uint8_t* d = fs_view(n, &got); if (got != len) return false;
+    for (uint32_t i = 0; i < len; i++) if (d[i] != (uint8_t)(i * seed)) return false;
+    return true;
+}
+void disk_node(int n, FsNode* f, bool write) { // the on-disk copy of node n
+    uint8_t* p = &disk[FS_NODE_LBA * 512 + n * sizeof(FsNode)];
+    for (uint32_t i = 0; i < sizeof(FsNode); i++) if (write) p[i] = ((uint8_t*)f)[i]; else ((uint8_t*)f)[i] = p[i];
+}
+
+void unreadable() {
+    hosted_disk_fail_reads = 1; uint32_t w = hosted_disk_writes;
+    expect("unreadable disk: mount refused", !boot() && !fs_persistent);
+    make("a", 3, sizeof(data)); fs_sync(); storage_sync();
+    expect("unreadable disk: never written", hosted_disk_writes == w);
+    hosted_disk_fail_reads = 0;
+}
+void blank() {
+    expect("blank disk: formatted", boot() && fs_persistent && fs_blocks <= DISK_SECTORS - FS_DATA_LBA);
+    make("a", 3, sizeof(data)); storage_sync();
+    expect("blank disk: a file survives a reboot", boot() && holds("a", 3, sizeof(data)));
+}
+void failing_writes() { // every sync fails and the cache fills with dirty buffers; then the disk recovers
+    char name[16]; hosted_disk_fail_writes = 1;
+    for (int i = 0; i < 40; i++) { name_of(name, 'f', i); make(name, i + 5, sizeof(data)); fs_sync(); }
+    storage_sync(); hosted_disk_fail_writes = 0; storage_sync();
+    bool ok = boot(); for (int i = 0; i < 40; i++) { name_of(name, 'f', i); ok = ok && holds(name, i + 5, sizeof(data)); }
+    expect("failed writes: 40 files land once the disk recovers", ok && holds("a", 3, sizeof(data)));
+    // A few buffers stay dirty from a failed sync, so the next large sync has to flush partway through.
+    hosted_disk_fail_writes = 1; make("h", 4, sizeof(data)); fs_sync(); storage_sync(); hosted_disk_fail_writes = 0;
+    for (int i = 0; i < 40; i++) { name_of(name, 'k', i); make(name, i + 9, sizeof(data)); }
+    storage_sync(); ok = boot() && holds("h", 4, sizeof(data)); for (int i = 0; i < 40; i++) { name_of(name, 'k', i); ok = ok && holds(name, i + 9, sizeof(data)); }
+    expect("failed writes: a sync that flushes partway loses nothing", ok);
+}
+void many_files() { // a large file, thousands of small ones, every other one deleted
+    char name[16]; for (uint32_t i = 0; i < sizeof(big); i++) big[i] = i * 7;
+    bool ok = fs_save(0, "big", big, sizeof(big), FS_TEXT) >= 0;
+    for (int i = 0; i < 3000; i++) { name_of(name, 'g', i); make(name, i, 1 + i % 7 * 100); }
+    for (int i = 0; i < 3000; i += 2) { name_of(name, 'g', i); ok = ok && fs_delete(fs_lookup(0, name)); }
+    uint32_t free_blocks = fs_free_blocks; storage_sync(); ok = ok && boot() && fs_free_blocks == free_blocks;
+    for (int i = 0; i < 3000; i++) { name_of(name, 'g', i); ok = ok && ((i & 1) ? holds(name, i, 1 + i % 7 * 100) : fs_lookup(0, name) < 0); }
+    uint32_t len; const uint8_t* d = fs_view(fs_lookup(0, "big"), &len); ok = ok && len == sizeof(big);
+    for (uint32_t i = 0; ok && i < len; i++) ok = d[i] == (uint8_t)(i * 7);
+    expect("2 MB file, 3000 files, 1500 deletes survive a reboot", ok);
+}
+void corrupt() { // a damaged node table is refused like an unreadable disk, and left as it is
+    int n = fs_lookup(0, "big"); FsNode good, bad; disk_node(n, &good, false);
+    bad = good; bad.start = 0xFFFFFF00; disk_node(n, &bad, true); uint32_t w = hosted_disk_writes;
+    expect("node extent past the store: mount refused", !boot() && !fs_persistent);
+    make("b", 9, sizeof(data)); storage_sync(); expect("node extent past the store: never written", hosted_disk_writes == w);
+    bad = good; bad.next_sibling = FS_MAX_NODES; disk_node(n, &bad, true);
+    expect("sibling index past the node table: mount refused", !boot() && !fs_persistent);
+    disk_node(n, &good, true); expect("repaired node table mounts again", boot() && holds("a", 3, sizeof(data)));
+}
+
+int main() {
+    MultibootInfo mb = { .flags = 1, .mem_upper = hosted_ram_size / 1024 };
+    pmm_base = (uintptr_t)kernel_end - 0x100000; pmm_init(MULTIBOOT_MAGIC, &mb);
+    gfx_init(); np_init();
+    hosted_disk = disk; hosted_disk_sectors = DISK_SECTORS;
+    unreadable(); blank(); failing_writes(); many_files(); corrupt();
+    if (failures) fprintf(stderr, "disktest: %d checks failed\n", failures);
+    return failures != 0;
+}
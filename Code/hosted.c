@@ -0,0 +1,54 @@
+/* Stub hardware for the hosted build ("make bench"): kernel.c runs as an ordinary Linux process.
+ * Nothing is plugged in. Ports read like a floating bus, so the ATA probe, COM1 and the VBE
+ * adapter all come up absent and the kernel stays on its text-mode, RAM-only paths. A test can
+ * plug in a primary-master disk instead (see hosted_disk), which answers the PIO commands
+ * section 5c sends: IDENTIFY, READ SECTORS, WRITE SECTORS and CACHE FLUSH. */
+#include <stdint.h>
+
+uint16_t hosted_vga[80 * 25]; // VGA_ADDR
+uint8_t kernel_end[64 << 20] __attribute__((aligned(4096))); // "physical RAM" above 1 MiB starts where the kernel image ends
+const uint32_t hosted_ram_size = sizeof(kernel_end);
+uint32_t irq_stub_table[16];
+uint8_t ipi_wake_stub[1], apic_spurious_stub[1], ap_trampoline[1], ap_trampoline_end[1]; // never run: one CPU, no IDT
+
+// Set hosted_disk before ata_init() to plug a disk of hosted_disk_sectors sectors in. While a fail
+// flag is set, every read or write command (writes include the cache flush) ends with ERR.
+uint8_t* hosted_disk = 0; uint32_t hosted_disk_sectors = 0, hosted_disk_writes = 0; // sectors written
+int hosted_disk_fail_reads = 0, hosted_disk_fail_writes = 0;
+static uint8_t ata_regs[8], ata_status; // status: 0x40 ready, 0x08 a sector to transfer, 0x01 error
+static uint16_t ata_ident[256]; static uint8_t* ata_xfer; static uint32_t ata_left; static int ata_writing;
+
+static void ata_command(uint8_t cmd) {
+    uint32_t lba = ata_regs[3] | ata_regs[4] << 8 | ata_regs[5] << 16 | (uint32_t)(ata_regs[6] & 0x0F) << 24, count = ata_regs[2] ? ata_regs[2] : 256;
+    ata_status = 0x41; ata_left = 0;
+    if (cmd == 0xEC) { ata_ident[60] = hosted_disk_sectors & 0xFFFF; ata_ident[61] = hosted_disk_sectors >> 16; ata_xfer = (uint8_t*)ata_ident; ata_left = 1; ata_writing = 0; ata_status = 0x48; }
+    else if ((cmd == 0x20 || cmd == 0x30) && !(cmd == 0x30 ? hosted_disk_fail_writes : hosted_disk_fail_reads) && lba + count <= hosted_disk_sectors) { ata_xfer = hosted_disk + lba * 512; ata_left = count; ata_writing = cmd == 0x30; ata_status = 0x48; }
+    else if (cmd == 0xE7 && !hosted_disk_fail_writes) ata_status = 0x40;
+}
+static void ata_sector_done() { ata_xfer += 512; ata_status = --ata_left ? 0x48 : 0x40; }
+
+uint8_t inb(uint16_t port) {
+    if (port == 0x64) return 0x00; // the 8042 never has a byte waiting
+    if (hosted_disk && (port == 0x1F7 || port == 0x3F6)) return ata_status;
+    if (hosted_disk && (port == 0x1F4 || port == 0x1F5)) return 0; // an ATA signature, not ATAPI
+    return 0xFF;
+}
+uint16_t inw(uint16_t port) { (void)port; return 0xFFFF; }
+uint32_t inl(uint16_t port) { (void)port; return 0xFFFFFFFF; }
+void outb(uint16_t port, uint8_t val) {
+    if (!hosted_disk || port < 0x1F2 || port > 0x1F7) return;
+    if (port == 0x1F7) ata_command(val); else ata_regs[port - 0x1F0] = val;
+}
+void outw(uint16_t port, uint16_t val) { (void)port; (void)val; }
+void outl(uint16_t port, uint32_t val) { (void)port; (void)val; }
+void insw(uint16_t port, void* buf, uint32_t count) {
+    uint16_t* p = buf;
+    if (port == 0x1F0 && ata_left && !ata_writing && count == 256) { for (int i = 0; i < 512; i++) ((uint8_t*)p)[i] = ata_xfer[i]; ata_sector_done(); return; }
+    while (count--) *p++ = 0xFFFF;
+}
+void outsw(uint16_t port, const void* buf, uint32_t count) {
+    if (port != 0x1F0 || !ata_left || !ata_writing || count != 256) return;
+    for (int i = 0; i < 512; i++) ata_xfer[i] = ((const uint8_t*)buf)[i];
+    hosted_disk_writes++; ata_sector_done();
+}
+void switch_context(uintptr_t* save_esp, uintptr_t load_esp) { (void)save_esp; (void)load_esp; } // the scheduler is never started
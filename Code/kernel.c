@@ -3,9 +3,15 @@
 #include <stdint.h>
 
 /* --- 1. SYSTEM DEFINITIONS --- */
-#define SCREEN_W 80
-#define SCREEN_H 25
+#define TEXT_W 80
+#define TEXT_H 25
+#ifdef HOSTED
+extern uint16_t hosted_vga[]; // hosted.c
+#define VGA_ADDR hosted_vga
+#else
 #define VGA_ADDR 0xB8000
+#endif
+int SCREEN_W = TEXT_W, SCREEN_H = TEXT_H; // cell grid; larger in framebuffer mode (section 4)
 #define SHUTDOWN_PORT 0x604
 #define SHUTDOWN_CMD  0x2000
 
@@ -23,28 +29,50 @@ int MOUSE_SPEED = 1;
 uint8_t DESKTOP_COLOR = CYAN;
 char USERNAME[20] = "Leo";
 char PASSWORD[20] = "123";
-long system_ticks = 0; // Uptime counter
 
 /* FILE SYSTEM (RAM DISK) */
+#define FS_BLOCK_SIZE 512
+#define FS_MIN_BLOCKS 2048          // 1 MiB of file data at least...
+#define FS_MAX_BLOCKS (256 * 1024)  // ...and 128 MiB at most, see fs_init()
+#define FS_MAX_NODES 4096   // files + directories, node 0 is the root directory
+#define FS_HASH_SIZE 4096   // name index buckets, power of two
+#define FS_NAME_LEN 16
+enum fs_type { FS_FREE = 0, FS_DIR, FS_TEXT, FS_IMAGE };
 typedef struct {
-    char name[16];
-    char content[2048]; // 2KB per file (enough for Paint images)
-    bool used;
-    bool is_image;
-} File;
+    char name[FS_NAME_LEN];
+    uint8_t type;
+    uint16_t parent, hash_next;                              // 0 terminates: the root is never a child or in a chain
+    uint16_t first_child, last_child, next_sibling, prev_sibling;
+    uint32_t child_count;
+    uint32_t size;                                           // bytes of data
+    uint32_t start, nblocks;                                 // one contiguous extent in ram_disk
+} FsNode;
 
-File ram_disk[10]; 
+uint32_t fs_blocks = 0;  // size of the store, fixed by fs_init() and fs_mount()
+uint8_t* ram_disk;       // fs_blocks * FS_BLOCK_SIZE bytes from arena_fs
+uint32_t* fs_bitmap;     // 1 = block in use, one bit per block from arena_fs
+FsNode fs_nodes[FS_MAX_NODES];
+uint16_t fs_hash[FS_HASH_SIZE];
+uint16_t fs_free_node = 0; // free node list, linked through next_sibling
+uint32_t fs_free_blocks = 0, fs_version = 0; // fs_version bumps on any namespace change
+int fs_cwd = 0; // directory shown in the Explorer and used by Save As
 char clipboard[512] = ""; 
 
 /* GUI STATE */
-uint16_t back_buffer[SCREEN_W * SCREEN_H]; 
-uint8_t paint_canvas[60 * 20]; 
+uint16_t* back_buffer; // screen-sized, from arena_gfx
+uint16_t* front_buffer; // shadow of what is currently in VGA memory
+uint8_t* vis_map; // z-level of the window body visible in each cell, 0 = desktop
 int settings_edit_mode = 0; 
 
 /* APP STATE: NOTEPAD */
-char np_buffer[512] = ""; 
+uint32_t np_cap, np_max_lines; // sized from free RAM by np_init()
+char* np_buf;                  // gap buffer: text is np_buf[0, np_gap) + np_buf[np_gap_end, np_cap)
+uint32_t np_gap, np_gap_end;   // the cursor always sits at the gap
+uint32_t* np_lines;            // line starts, also gapped: see section 6b
+uint32_t np_line_gap, np_line_gap_end;
+uint32_t np_top = 0, np_left = 0; // viewport: first visible line and column
+int np_dir = 0;
 char np_filename[16] = "Untitled.txt";
-int np_cursor = 0; 
 int np_menu_open = 0; 
 bool np_bold = false;
 
@@ -58,19 +86,28 @@ int dialog_mode = 0; // 1=Notepad Save, 2=Paint Save, 3=Paint Load
 int paint_menu = 0; 
 uint8_t paint_color = BLACK; 
 char paint_filename[16] = "drawing.png";
+int paint_src = -1; // file node the image is viewed from until the first stroke, -1 = paint_canvas
+int paint_dir = 0;
+uint8_t* paint_canvas; // paint_w * paint_h colour indices, 0xFF = blank, from arena_paint
+int paint_w, paint_h;
+int paint_tool = 0; // 0 = pencil, 1 = line, 2 = flood fill
 
 /* APP STATE: CALCULATOR */
 int calc_acc = 0, calc_curr = 0; 
 char calc_op = 0; 
 bool calc_new_entry = true;
 
-/* APP STATE: SNAKE GAME */
-int snake_x[100], snake_y[100]; 
+/* APP STATE: SNAKE GAME (section 7) */
+#define SNAKE_RING 8192 // body ring buffer, a power of two above any playfield (the 128x48 grid included)
+uint16_t snake_ring[SNAKE_RING]; // body cells (y * snake_w + x), tail at snake_tail, head snake_len - 1 after it
+uint32_t snake_occ[SNAKE_RING / 32]; // 1 = body, or beyond the playfield
+uint32_t snake_tail = 0;
 int snake_len = 3; 
 int snake_dir = 1; 
-int food_x = 10, food_y = 10;
+int snake_w = 28, snake_h = 11; // playfield: the window's client area when the game started
+int snake_food = -1;
 bool game_over = false; 
-int game_tick = 0;
+#define SNAKE_STEP_MS 150
 
 /* LOGIN STATE */
 char login_user[20] = ""; 
@@ -79,99 +116,1700 @@ bool login_focus_pass = false;
 bool shift_pressed = false;
 
 /* --- 2. LOW LEVEL I/O --- */
+#ifdef HOSTED // "make bench": the same code runs as a Linux process, ports are simulated by hosted.c
+uint8_t inb(uint16_t port); void outb(uint16_t port, uint8_t val); void outw(uint16_t port, uint16_t val); uint16_t inw(uint16_t port);
+void outl(uint16_t port, uint32_t val); uint32_t inl(uint16_t port); void insw(uint16_t port, void* buf, uint32_t count); void outsw(uint16_t port, const void* buf, uint32_t count);
+#else
 static inline uint8_t inb(uint16_t port) { uint8_t ret; asm volatile ( "inb %1, %0" : "=a"(ret) : "Nd"(port) ); return ret; }
 static inline void outb(uint16_t port, uint8_t val) { asm volatile ( "outb %0, %1" : : "a"(val), "Nd"(port) ); }
 static inline void outw(uint16_t port, uint16_t val) { asm volatile ( "outw %0, %1" : : "a"(val), "Nd"(port) ); }
-void sys_shutdown() { outw(SHUTDOWN_PORT, SHUTDOWN_CMD); asm volatile("hlt"); }
-void sys_reboot() { uint8_t good = 0x02; while (good & 0x02) good = inb(0x64); outb(0x64, 0xFE); asm volatile("hlt"); }
+static inline uint16_t inw(uint16_t port) { uint16_t ret; asm volatile ( "inw %1, %0" : "=a"(ret) : "Nd"(port) ); return ret; }
+static inline void outl(uint16_t port, uint32_t val) { asm volatile ( "outl %0, %1" : : "a"(val), "Nd"(port) ); }
+static inline uint32_t inl(uint16_t port) { uint32_t ret; asm volatile ( "inl %1, %0" : "=a"(ret) : "Nd"(port) ); return ret; }
+static inline void insw(uint16_t port, void* buf, uint32_t count) { asm volatile ( "rep insw" : "+D"(buf), "+c"(count) : "d"(port) : "memory" ); }
+static inline void outsw(uint16_t port, const void* buf, uint32_t count) { asm volatile ( "rep outsw" : "+S"(buf), "+c"(count) : "d"(port) : "memory" ); }
+#endif
+static inline void copy32(void* dst, const void* src, uint32_t count) { asm volatile ( "rep movsl" : "+D"(dst), "+S"(src), "+c"(count) : : "memory" ); } // count dwords
+void storage_sync(); // section 6: write everything back to disk before power goes away
+void sys_shutdown() { storage_sync(); outw(SHUTDOWN_PORT, SHUTDOWN_CMD); asm volatile("hlt"); }
+void sys_reboot() { storage_sync(); uint8_t good = 0x02; while (good & 0x02) good = inb(0x64); outb(0x64, 0xFE); asm volatile("hlt"); }
+static inline void io_wait() { outb(0x80, 0); }
+#ifdef HOSTED // a process has no interrupts to mask, and the scheduler is never started
+static inline void cli() {}
+static inline void sti() {}
+static inline uint32_t irq_save() { return 0x200; }
+#else
+static inline void cli() { asm volatile("cli" ::: "memory"); }
+static inline void sti() { asm volatile("sti" ::: "memory"); }
+static inline uint32_t irq_save() { uint32_t f; asm volatile("pushf; pop %0; cli" : "=r"(f) :: "memory"); return f; } // for sections that may already run with IF=0
+#endif
+static inline void irq_restore(uint32_t f) { if (f & 0x200) sti(); }
+static inline void barrier() { asm volatile("" ::: "memory"); }
+// Spinlocks guard state shared with other CPUs (section 3e). Take them with IRQs off: the holder must never be preempted.
+typedef struct { volatile uint32_t locked; } Spinlock;
+static inline void spin_lock(Spinlock* l) { while (__atomic_exchange_n(&l->locked, 1, __ATOMIC_ACQUIRE)) while (l->locked) asm volatile("pause"); }
+static inline void spin_unlock(Spinlock* l) { __atomic_store_n(&l->locked, 0, __ATOMIC_RELEASE); }
+
+/* --- 2b. INTERRUPTS (IDT, 8259 PIC OR LOCAL APIC + IOAPIC) --- */
+#define PIC1_CMD 0x20
+#define PIC1_DATA 0x21
+#define PIC2_CMD 0xA0
+#define PIC2_DATA 0xA1
+#define IRQ_BASE 0x20 // IRQ0-15 land on vectors 0x20-0x2F, clear of CPU exceptions
+
+typedef struct __attribute__((packed)) { uint16_t base_lo; uint16_t sel; uint8_t zero; uint8_t flags; uint16_t base_hi; } IdtEntry;
+struct __attribute__((packed)) { uint16_t limit; uint32_t base; } idt_ptr;
+IdtEntry idt[256];
+extern uint32_t irq_stub_table[16]; // boot.s
+extern uint8_t ipi_wake_stub[], apic_spurious_stub[]; // boot.s
+
+void idt_set(int vec, uint32_t handler) { idt[vec] = (IdtEntry){ handler & 0xFFFF, 0x08, 0, 0x8E, handler >> 16 }; } // present, ring 0, 32-bit interrupt gate
+void pic_remap() {
+    outb(PIC1_CMD, 0x11); io_wait(); outb(PIC2_CMD, 0x11); io_wait();          // ICW1: init + ICW4
+    outb(PIC1_DATA, IRQ_BASE); io_wait(); outb(PIC2_DATA, IRQ_BASE + 8); io_wait(); // ICW2: vector offsets
+    outb(PIC1_DATA, 4); io_wait(); outb(PIC2_DATA, 2); io_wait();              // ICW3: slave on IRQ2
+    outb(PIC1_DATA, 1); io_wait(); outb(PIC2_DATA, 1); io_wait();              // ICW4: 8086 mode
+    outb(PIC1_DATA, 0xFF); outb(PIC2_DATA, 0xFF);                               // everything masked until irq_unmask()
+}
+/* With an IOAPIC in the MADT (section 3e) the 8259s stay masked and ISA IRQs come through the
+ * IOAPIC instead, still on vectors IRQ_BASE + irq and always to the boot CPU. Every CPU enables
+ * its local APIC, which also carries the wake-up IPIs for idle application processors. */
+#define LAPIC_ID 0x20
+#define LAPIC_EOI 0xB0
+#define LAPIC_SVR 0xF0
+#define LAPIC_ICR_LO 0x300
+#define LAPIC_ICR_HI 0x310
+#define VEC_WAKE 0xF0     // IPI: there are jobs to run
+#define VEC_SPURIOUS 0xFF // local APIC spurious vector, needs no EOI
+volatile uint32_t* lapic = NULL; // MMIO, NULL until the MADT is found
+volatile uint32_t* ioapic = NULL;
+uint32_t ioapic_gsi_base = 0;
+uint8_t isa_gsi[16] = { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 }; // MADT interrupt source overrides
+uint16_t isa_flags[16];
+uint8_t bsp_apic_id = 0;
+bool ioapic_mode = false;
+
+static inline uint32_t lapic_read(uint32_t reg) { return lapic[reg / 4]; }
+static inline void lapic_write(uint32_t reg, uint32_t val) { lapic[reg / 4] = val; }
+void lapic_enable() { lapic_write(LAPIC_SVR, 0x100 | VEC_SPURIOUS); }
+void lapic_ipi(uint8_t apic_id, uint32_t icr) {
+    uint32_t f = irq_save();
+    while (lapic_read(LAPIC_ICR_LO) & (1 << 12)) asm volatile("pause"); // previous IPI still being delivered
+    lapic_write(LAPIC_ICR_HI, (uint32_t)apic_id << 24); lapic_write(LAPIC_ICR_LO, icr);
+    irq_restore(f);
+}
+uint32_t ioapic_read(uint32_t reg) { ioapic[0] = reg; return ioapic[4]; }
+void ioapic_write(uint32_t reg, uint32_t val) { ioapic[0] = reg; ioapic[4] = val; }
+void ioapic_route(int irq) { // ISA polarity/trigger come from the override flags: 3 = active low / level
+    uint32_t pin = isa_gsi[irq] - ioapic_gsi_base, lo = IRQ_BASE + irq;
+    if ((isa_flags[irq] & 3) == 3) lo |= 1 << 13;
+    if (((isa_flags[irq] >> 2) & 3) == 3) lo |= 1 << 15;
+    ioapic_write(0x10 + pin * 2 + 1, (uint32_t)bsp_apic_id << 24); ioapic_write(0x10 + pin * 2, lo);
+}
+void ioapic_init() { // every pin masked until irq_unmask()
+    int pins = ((ioapic_read(1) >> 16) & 0xFF) + 1;
+    for (int i = 0; i < pins; i++) { ioapic_write(0x10 + i * 2, 1 << 16); ioapic_write(0x10 + i * 2 + 1, 0); }
+    ioapic_mode = true;
+}
+
+void irq_unmask(int irq) {
+    if (ioapic_mode) { ioapic_route(irq); return; }
+    uint16_t port = irq < 8 ? PIC1_DATA : PIC2_DATA; outb(port, inb(port) & ~(1 << (irq & 7))); if (irq >= 8) irq_unmask(2); }
+void pic_eoi(int irq) {
+    if (ioapic_mode) { lapic_write(LAPIC_EOI, 0); return; }
+    if (irq >= 8) outb(PIC2_CMD, 0x20);
+    outb(PIC1_CMD, 0x20);
+}
+void idt_load() { asm volatile("lidt %0" : : "m"(idt_ptr)); } // application processors share the table
+void idt_init() {
+    pic_remap();
+    for (int i = 0; i < 16; i++) idt_set(IRQ_BASE + i, irq_stub_table[i]);
+    idt_set(VEC_WAKE, (uint32_t)(uintptr_t)ipi_wake_stub); idt_set(VEC_SPURIOUS, (uint32_t)(uintptr_t)apic_spurious_stub);
+    idt_ptr.limit = sizeof(idt) - 1; idt_ptr.base = (uint32_t)(uintptr_t)idt;
+    idt_load();
+}
+
+/* --- 2c. TIMEBASE (8254 PIT + TSC) AND TIMER WHEEL --- */
+#define PIT_HZ 1193182
+#define PIT_DIVISOR 1193 // ~1000.15 Hz on channel 0
+volatile uint32_t clock_ms = 0; // monotonic milliseconds since pit_init(), wraps after ~49 days
+volatile uint64_t last_tick_tsc = 0;
+uint32_t pit_frac = 0;
+uint32_t tsc_khz = 0; // TSC cycles per millisecond, 0 if calibration failed
+
+static inline uint64_t rdtsc() { uint32_t lo, hi; asm volatile("rdtsc" : "=a"(lo), "=d"(hi)); return ((uint64_t)hi << 32) | lo; }
+
+void tsc_calibrate() {
+    // PIT channel 2 in one-shot mode with the gate driven from port 0x61: OUT2 (bit 5) goes high after 10 ms.
+    uint16_t latch = PIT_HZ / 100;
+    outb(0x61, (inb(0x61) & ~0x02) | 0x01);
+    outb(0x43, 0xB0); outb(0x42, latch & 0xFF); outb(0x42, latch >> 8);
+    uint64_t t0 = rdtsc(); uint32_t spins = 0;
+    while (!(inb(0x61) & 0x20) && ++spins < 10000000) {}
+    uint64_t t1 = rdtsc();
+    tsc_khz = (spins < 10000000) ? (uint32_t)(t1 - t0) / 10 : 0;
+}
+void pit_init() {
+    outb(0x43, 0x34); outb(0x40, PIT_DIVISOR & 0xFF); outb(0x40, PIT_DIVISOR >> 8); // channel 0, lo/hi, mode 2 (rate generator)
+}
+void pit_irq() {
+    // Each tick is PIT_DIVISOR/PIT_HZ s. Accumulate in units of 1/PIT_HZ ms so clock_ms never drifts.
+    pit_frac += PIT_DIVISOR * 1000;
+    while (pit_frac >= PIT_HZ) { pit_frac -= PIT_HZ; clock_ms++; }
+    last_tick_tsc = rdtsc();
+}
+uint32_t clock_us() { // sub-millisecond resolution from the TSC, interpolated since the last PIT tick
+    uint32_t f = irq_save(); uint32_t ms = clock_ms; uint64_t t = last_tick_tsc; irq_restore(f);
+    uint32_t us = 0; if (tsc_khz >= 1000) { us = (uint32_t)(rdtsc() - t) / (tsc_khz / 1000); if (us > 999) us = 999; }
+    return ms * 1000 + us;
+}
+void delay_us(uint32_t us) { uint32_t t = clock_us(); while (clock_us() - t < us) asm volatile("pause"); } // needs IRQs on
+
+/* Hierarchical timer wheel: 256 x 1 ms slots, then 64 x 256 ms and 64 x 16.384 s slots that
+ * cascade down as time advances. Timers are caller-owned and intrusive; callbacks run from
+ * timer_run() in the timer task with gui_lock held, never in IRQ context. */
+typedef struct Timer { struct Timer* next; struct Timer** pprev; uint32_t expires, period; void (*fn)(void*); void* arg; } Timer;
+#define TW0_SIZE 256
+#define TW1_SIZE 64
+#define TW2_SIZE 64
+Timer* tw0[TW0_SIZE]; Timer* tw1[TW1_SIZE]; Timer* tw2[TW2_SIZE];
+uint32_t tw_now = 0; // next millisecond the wheel will process
+int timer_count = 0;
+
+void timer_enqueue(Timer* t) {
+    uint32_t delta = t->expires - tw_now; Timer** slot;
+    if ((int32_t)delta < 0) slot = &tw0[tw_now & (TW0_SIZE-1)];
+    else if (delta < TW0_SIZE) slot = &tw0[t->expires & (TW0_SIZE-1)];
+    else if (delta < TW0_SIZE * TW1_SIZE) slot = &tw1[(t->expires >> 8) & (TW1_SIZE-1)];
+    else if (delta < TW0_SIZE * TW1_SIZE * TW2_SIZE) slot = &tw2[(t->expires >> 14) & (TW2_SIZE-1)];
+    else slot = &tw2[((tw_now >> 14) + TW2_SIZE - 1) & (TW2_SIZE-1)]; // out of range: park in the last slot and re-slot on cascade
+    t->next = *slot; if (t->next) t->next->pprev = &t->next; t->pprev = slot; *slot = t;
+}
+bool timer_pending(Timer* t) { return t->pprev != NULL; }
+void timer_cancel(Timer* t) {
+    if (!t->pprev) return;
+    *t->pprev = t->next; if (t->next) t->next->pprev = t->pprev;
+    t->next = NULL; t->pprev = NULL; timer_count--;
+}
+void timer_start(Timer* t, uint32_t delay_ms, uint32_t period_ms, void (*fn)(void*), void* arg) {
+    timer_cancel(t);
+    if (timer_count == 0) tw_now = clock_ms; // idle wheel: skip straight to now instead of walking empty slots
+    t->expires = clock_ms + delay_ms; t->period = period_ms; t->fn = fn; t->arg = arg;
+    timer_enqueue(t); timer_count++;
+}
+void timer_cascade(Timer** slot) { Timer* t = *slot; *slot = NULL; while (t) { Timer* n = t->next; timer_enqueue(t); t = n; } }
+void timer_run() {
+    uint32_t now = clock_ms;
+    if (timer_count == 0) { tw_now = now + 1; return; }
+    while ((int32_t)(now - tw_now) >= 0) {
+        uint32_t idx = tw_now & (TW0_SIZE-1);
+        if (idx == 0) { uint32_t i1 = (tw_now >> 8) & (TW1_SIZE-1); if (i1 == 0) timer_cascade(&tw2[(tw_now >> 14) & (TW2_SIZE-1)]); timer_cascade(&tw1[i1]); }
+        Timer* t;
+        while ((t = tw0[idx])) {
+            timer_cancel(t);
+            if ((int32_t)(t->expires - tw_now) > 0) { timer_enqueue(t); timer_count++; continue; } // parked far timer, not due yet
+            if (t->period) { t->expires += t->period; timer_enqueue(t); timer_count++; }
+            t->fn(t->arg); // may cancel or restart t
+        }
+        tw_now++;
+    }
+}
 
 /* --- 3. UTILS --- */
 int strlen(const char* str) { int len = 0; while (str[len]) len++; return len; }
 bool streq(const char* s1, const char* s2) { int i = 0; while(s1[i] && s2[i]) { if(s1[i] != s2[i]) return false; i++; } return s1[i] == s2[i]; }
 void strcpy_safe(char* dest, const char* src, int max) { int i=0; while(src[i] && i<max-1) { dest[i]=src[i]; i++; } dest[i]=0; }
 void memset(void *dest, int val, size_t len) { unsigned char *ptr = dest; while (len-- > 0) *ptr++ = val; }
+char* fmt_str(char* out, const char* s) { while (*s) *out++ = *s++; *out = 0; return out; } // returns the end of the string
+char* fmt_uint(char* out, uint32_t n) { char t[10]; int i = 0; do { t[i++] = '0' + n % 10; n /= 10; } while (n); while (i) *out++ = t[--i]; *out = 0; return out; } // returns the end of the string
+char* fmt_int(char* out, int32_t n) { if (n < 0) *out++ = '-'; return fmt_uint(out, n < 0 ? 0u - (uint32_t)n : (uint32_t)n); }
+char* fmt_hex(char* out, uint32_t n) { for (int i = 28; i >= 0; i -= 4) *out++ = "0123456789abcdef"[(n >> i) & 15]; *out = 0; return out; } // always 8 digits
+bool has_prefix(const char* p, const char* end, const char* pre) { while (*pre) if (p >= end || *p++ != *pre++) return false; return true; } // p..end need not be terminated
+// Skips spaces, then reads an optionally negative decimal. Returns the end of the number, NULL if there was none.
+const char* parse_int(const char* p, const char* end, int32_t* v) {
+    while (p < end && *p == ' ') p++;
+    bool neg = p < end && *p == '-'; if (neg) p++;
+    if (p >= end || *p < '0' || *p > '9') return NULL;
+    int32_t n = 0; while (p < end && *p >= '0' && *p <= '9') n = n * 10 + (*p++ - '0');
+    *v = neg ? -n : n; return p;
+}
+static inline bool bit_test(const uint32_t* map, uint32_t i) { return map[i >> 5] & (1u << (i & 31)); }
+static inline void bit_set(uint32_t* map, uint32_t i) { map[i >> 5] |= 1u << (i & 31); }
+static inline void bit_clear(uint32_t* map, uint32_t i) { map[i >> 5] &= ~(1u << (i & 31)); }
+static inline uint32_t align_up(uint32_t v, uint32_t a) { return (v + a - 1) & ~(a - 1); }
+static inline int imin(int a, int b) { return a < b ? a : b; }
+static inline int imax(int a, int b) { return a > b ? a : b; }
+typedef struct { int x, y, w, h; } Rect;
 int rand_pseudo() { static int seed = 12345; seed = seed * 1103515245 + 12345; return (unsigned int)(seed/65536) % 32768; }
 
+/* --- 3b. MEMORY: PAGE ALLOCATOR, SLAB HEAP, ARENAS --- */
+/* Physical pages are tracked in a bitmap (1 = used) built from the multiboot memory map and kept
+ * in the first free RAM above the kernel. Paging is off, so page p lives at pmm_base + p * 4 KiB. */
+#define PAGE_SIZE 4096
+#define MULTIBOOT_MAGIC 0x2BADB002
+typedef struct { uint32_t flags, mem_lower, mem_upper, boot_device, cmdline, mods_count, mods_addr, syms[4], mmap_length, mmap_addr; } MultibootInfo;
+typedef struct __attribute__((packed)) { uint32_t size; uint64_t addr, len; uint32_t type; } MultibootMmap;
+typedef struct { uint32_t start, end, cmdline, pad; } MultibootModule;
+char boot_cmdline[128]; // copied before the page allocator can hand out the memory it sits in
+void cmdline_init(uint32_t magic, const MultibootInfo* mb) { if (magic == MULTIBOOT_MAGIC && (mb->flags & (1 << 2))) strcpy_safe(boot_cmdline, (const char*)(uintptr_t)mb->cmdline, sizeof(boot_cmdline)); }
+bool cmdline_has(const char* opt) { // matches whole space-separated words
+    for (const char* p = boot_cmdline; *p; ) {
+        int n = 0; while (p[n] && p[n] != ' ') n++;
+        int i = 0; while (i < n && opt[i] == p[i]) i++; if (i == n && !opt[i]) return true;
+        p += n; while (*p == ' ') p++;
+    }
+    return false;
+}
+extern uint8_t kernel_end[]; // boot.s
+uintptr_t pmm_base = 0;
+uint32_t* pmm_bitmap;
+uint32_t pmm_pages = 0;                // page frames covered by the bitmap
+uint32_t pmm_total = 0, pmm_used = 0;  // usable RAM pages, and how many of them are taken
+uint32_t pmm_hint = 0;                 // allocation scan starts here
+static inline void* page_addr(uint32_t p) { return (void*)(pmm_base + (uintptr_t)p * PAGE_SIZE); }
+static inline uint32_t page_index(const void* a) { return ((uintptr_t)a - pmm_base) / PAGE_SIZE; }
+
+void pmm_mark(uint32_t first, uint32_t count, bool used) {
+    for (uint32_t p = first; p < first + count && p < pmm_pages; p++) {
+        if (bit_test(pmm_bitmap, p) == used) continue;
+        if (used) { bit_set(pmm_bitmap, p); pmm_used++; } else { bit_clear(pmm_bitmap, p); pmm_used--; }
+    }
+}
+// Calls fn on every usable RAM range below 4 GiB. Without a map, assume the usual 1 MiB hole and mem_upper above it.
+void pmm_each_region(const MultibootInfo* mb, void (*fn)(uint64_t start, uint64_t end)) {
+    if (mb && (mb->flags & (1 << 6))) {
+        for (uintptr_t e = mb->mmap_addr; e < mb->mmap_addr + mb->mmap_length; e += ((MultibootMmap*)e)->size + 4) {
+            MultibootMmap* m = (MultibootMmap*)e;
+            if (m->type == 1 && m->addr < 0x100000000ULL) fn(m->addr, m->addr + m->len < 0x100000000ULL ? m->addr + m->len : 0x100000000ULL);
+        }
+    } else fn(0x100000, 0x100000 + (uint64_t)(mb && (mb->flags & 1) ? mb->mem_upper : 15 * 1024) * 1024);
+}
+void pmm_region_top(uint64_t start, uint64_t end) { (void)start; if (end / PAGE_SIZE > pmm_pages) pmm_pages = end / PAGE_SIZE; }
+void pmm_region_free(uint64_t start, uint64_t end) {
+    uint32_t first = (start + PAGE_SIZE - 1) / PAGE_SIZE, last = end / PAGE_SIZE;
+    if (last > first) { pmm_total += last - first; pmm_used += last - first; pmm_mark(first, last - first, false); }
+}
+void pmm_init(uint32_t magic, const MultibootInfo* mb) {
+    if (magic != MULTIBOOT_MAGIC) mb = NULL;
+    pmm_each_region(mb, pmm_region_top);
+    // Everything the loader handed us ends somewhere above the kernel: modules, then the bitmap goes after them.
+    uintptr_t top = (uintptr_t)kernel_end;
+    if (mb && (mb->flags & (1 << 3))) for (uint32_t i = 0; i < mb->mods_count; i++) { uint32_t e = ((MultibootModule*)(uintptr_t)mb->mods_addr)[i].end; if (e > top) top = e; }
+    pmm_bitmap = (uint32_t*)((top + PAGE_SIZE - 1) & ~(uintptr_t)(PAGE_SIZE - 1));
+    uint32_t map_pages = (pmm_pages / 8 + PAGE_SIZE - 1) / PAGE_SIZE;
+    memset(pmm_bitmap, 0xFF, map_pages * PAGE_SIZE);
+    pmm_each_region(mb, pmm_region_free);
+    pmm_mark(0, 0x100000 / PAGE_SIZE, true); // BIOS data, VGA memory, option ROMs
+    pmm_mark(0x100000 / PAGE_SIZE, page_index(pmm_bitmap) + map_pages - 0x100000 / PAGE_SIZE, true); // kernel, modules, bitmap
+    pmm_hint = page_index(pmm_bitmap) + map_pages;
+}
+void* pmm_find(uint32_t count) { // first fit for `count` contiguous pages
+    for (int pass = 0; pass < 2; pass++) {
+        uint32_t run = 0;
+        for (uint32_t p = pass ? 0 : pmm_hint; p < pmm_pages; p++) {
+            if (!(p & 31) && pmm_bitmap[p >> 5] == 0xFFFFFFFF) { run = 0; p += 31; continue; } // skip full words
+            if (bit_test(pmm_bitmap, p)) { run = 0; continue; }
+            if (++run == count) { pmm_mark(p + 1 - count, count, true); pmm_hint = p + 1; return page_addr(p + 1 - count); }
+        }
+    }
+    return NULL;
+}
+// The allocators are shared by every task; their critical sections are short, so they just run with IRQs off.
+void* pmm_alloc(uint32_t count) { uint32_t f = irq_save(); void* p = pmm_find(count); irq_restore(f); return p; }
+void pmm_free(void* addr, uint32_t count) { uint32_t f = irq_save(), p = page_index(addr); pmm_mark(p, count, false); if (p < pmm_hint) pmm_hint = p; irq_restore(f); }
+
+/* kmalloc: power-of-two size classes from 16 to 2048 bytes, each served by one-page slabs with the
+ * header at the start of the page, so kfree finds it by rounding down. Larger requests take whole
+ * pages with the same header in front. */
+#define SLAB_MAGIC 0x51AB
+#define LARGE_MAGIC 0x1A46
+#define SLAB_CLASSES 8
+typedef struct Slab { uint16_t magic, cls; uint32_t inuse; struct Slab* next; void* free; } Slab; // large: cls = 0, inuse = pages
+typedef struct { uint32_t size; Slab* partial; } SlabCache; // partial: slabs with at least one free object
+SlabCache slab_caches[SLAB_CLASSES] = { {.size = 16}, {.size = 32}, {.size = 64}, {.size = 128}, {.size = 256}, {.size = 512}, {.size = 1024}, {.size = 2048} };
+uint32_t heap_bytes = 0; // live kmalloc bytes, rounded to their size class
+#define SLAB_HDR 32
+
+void* slab_alloc(uint32_t size) {
+    if (!size) return NULL;
+    if (size > 2048) {
+        uint32_t pages = (size + SLAB_HDR + PAGE_SIZE - 1) / PAGE_SIZE; Slab* s = pmm_alloc(pages); if (!s) return NULL;
+        s->magic = LARGE_MAGIC; s->inuse = pages; heap_bytes += pages * PAGE_SIZE; return (uint8_t*)s + SLAB_HDR;
+    }
+    int c = 0; while (slab_caches[c].size < size) c++;
+    SlabCache* sc = &slab_caches[c]; Slab* s = sc->partial;
+    if (!s) {
+        if (!(s = pmm_alloc(1))) return NULL;
+        s->magic = SLAB_MAGIC; s->cls = c; s->inuse = 0; s->next = NULL; s->free = NULL;
+        for (uint8_t* o = (uint8_t*)s + PAGE_SIZE - sc->size; o >= (uint8_t*)s + SLAB_HDR; o -= sc->size) { *(void**)o = s->free; s->free = o; }
+        sc->partial = s;
+    }
+    void* o = s->free; s->free = *(void**)o; s->inuse++; heap_bytes += sc->size;
+    if (!s->free) sc->partial = s->next; // now full: off the partial list until something is freed
+    return o;
+}
+void slab_free(void* p) {
+    if (!p) return;
+    Slab* s = (Slab*)((uintptr_t)p & ~(uintptr_t)(PAGE_SIZE - 1));
+    if (s->magic == LARGE_MAGIC) { heap_bytes -= s->inuse * PAGE_SIZE; s->magic = 0; pmm_free(s, s->inuse); return; }
+    if (s->magic != SLAB_MAGIC) return;
+    SlabCache* sc = &slab_caches[s->cls];
+    if (!s->free) { s->next = sc->partial; sc->partial = s; }
+    *(void**)p = s->free; s->free = p; s->inuse--; heap_bytes -= sc->size;
+    if (!s->inuse && (sc->partial != s || s->next)) { // keep one empty slab per class, give the rest back
+        Slab** l = &sc->partial; while (*l != s) l = &(*l)->next; *l = s->next;
+        s->magic = 0; pmm_free(s, 1);
+    }
+}
+
+void* kmalloc(uint32_t size) { uint32_t f = irq_save(); void* p = slab_alloc(size); irq_restore(f); return p; }
+void kfree(void* p) { uint32_t f = irq_save(); slab_free(p); irq_restore(f); }
+
+/* Arenas: bump allocation out of page chunks for data that lives and dies together. arena_reset()
+ * returns every chunk at once, e.g. when a subsystem is reinitialised or resized. Memory is zeroed. */
+#define ARENA_CHUNK_PAGES 16
+typedef struct ArenaChunk { struct ArenaChunk* next; uint32_t pages; } ArenaChunk;
+typedef struct { const char* name; ArenaChunk* chunks; uint8_t *cur, *end; uint32_t used, pages; } Arena;
+Arena arena_gfx = {.name = "gfx"};   // screen-sized buffers
+Arena arena_fs = {.name = "fs"};     // file data blocks
+Arena arena_text = {.name = "text"}; // Notepad document
+Arena arena_paint = {.name = "paint"}; // Paint canvas
+
+void* arena_alloc(Arena* a, uint32_t size) {
+    size = align_up(size, 16);
+    if (!a->cur || a->cur + size > a->end) {
+        uint32_t pages = (size + 16 + PAGE_SIZE - 1) / PAGE_SIZE; if (pages < ARENA_CHUNK_PAGES) pages = ARENA_CHUNK_PAGES;
+        ArenaChunk* c = pmm_alloc(pages); if (!c) return NULL;
+        c->next = a->chunks; c->pages = pages; a->chunks = c; a->pages += pages;
+        a->cur = (uint8_t*)c + 16; a->end = (uint8_t*)c + pages * PAGE_SIZE;
+    }
+    void* p = a->cur; a->cur += size; a->used += size; memset(p, 0, size); return p;
+}
+void arena_reset(Arena* a) {
+    while (a->chunks) { ArenaChunk* c = a->chunks; a->chunks = c->next; pmm_free(c, c->pages); }
+    a->cur = a->end = NULL; a->used = a->pages = 0;
+}
+uint32_t mem_free_bytes() { return (pmm_total - pmm_used) * PAGE_SIZE; }
+
+/* --- 3c. TASKS: SCHEDULER, LOCKS, MESSAGE QUEUES --- */
+/* Every task has its own kernel stack; switch_context (boot.s) pushes the callee-saved registers
+ * and swaps stack pointers. The run queue is a FIFO per priority and the highest non-empty level
+ * runs. The PIT tick rotates equal-priority tasks every TASK_SLICE_MS, and an IRQ that readies a
+ * higher-priority task switches to it on the way out. kernel_main's context becomes the idle task. */
+#define TASK_STACK_SIZE 16384
+#define TASK_SLICE_MS 10
+#define MSG_QUEUE_SIZE 32 // power of two
+enum { PRIO_HIGH, PRIO_NORMAL, PRIO_LOW, PRIO_IDLE, PRIO_LEVELS };
+enum { TASK_READY, TASK_RUNNING, TASK_BLOCKED };
+enum { WAIT_NONE, WAIT_EVENT, WAIT_MUTEX }; // task_wake() only ends WAIT_EVENT: mutex waiters are handed the lock instead
+typedef struct { int type, a, b; } Msg;
+typedef struct Task {
+    uintptr_t esp;                        // saved while switched out
+    const char* name;
+    uint8_t state, wait, prio, base_prio; // prio is raised above base_prio while a more urgent task waits on a mutex we hold
+    struct Task* next;                    // run queue or mutex wait list
+    void (*entry)(void*); void* arg;
+    uint32_t slice, locks_held, runtime_ms, switches;
+    Msg msgs[MSG_QUEUE_SIZE]; uint32_t msg_head, msg_tail, msg_dropped;
+    struct Task* room_waiter;             // blocked in msg_wait_room() until this queue drains
+} Task;
+typedef struct { Task* owner; uint32_t depth; Task* waiters; } Mutex; // recursive, FIFO hand-off
+extern void switch_context(uintptr_t* save_esp, uintptr_t load_esp); // boot.s
+Task idle_task = { .name = "idle", .state = TASK_RUNNING, .prio = PRIO_IDLE, .base_prio = PRIO_IDLE };
+Task* task_current = &idle_task;
+Task* run_head[PRIO_LEVELS]; Task* run_tail[PRIO_LEVELS];
+Task *input_task, *sys_task, *wm_task, *sync_task, *prof_task;
+bool sched_running = false, need_resched = false;
+uint32_t irq_depth = 0; // inside irq_handler: never block, and switch only on the way out
+Mutex gui_lock; // windows, app state, drawing and the file system; taken before disk_lock
+
+void run_push(Task* t) {
+    t->state = TASK_READY; t->next = NULL;
+    if (run_tail[t->prio]) run_tail[t->prio]->next = t; else run_head[t->prio] = t;
+    run_tail[t->prio] = t;
+    if (t->prio < task_current->prio) need_resched = true;
+}
+void run_remove(Task* t) {
+    Task *prev = NULL, **l = &run_head[t->prio];
+    while (*l && *l != t) { prev = *l; l = &(*l)->next; }
+    if (!*l) return;
+    *l = t->next; if (run_tail[t->prio] == t) run_tail[t->prio] = prev;
+}
+Task* run_pop() { for (int p = 0; p < PRIO_LEVELS; p++) if (run_head[p]) { Task* t = run_head[p]; if (!(run_head[p] = t->next)) run_tail[p] = NULL; return t; } return NULL; }
+void schedule() { // IF=0. A running caller goes to the back of its queue, a blocked one just leaves.
+    Task* prev = task_current; need_resched = false;
+    if (prev->state == TASK_RUNNING) run_push(prev);
+    Task* next = run_pop(); // never empty: idle is queued whenever it isn't running, and it never blocks
+    next->state = TASK_RUNNING; next->slice = TASK_SLICE_MS;
+    if (next == prev) return;
+    next->switches++; task_current = next; switch_context(&prev->esp, next->esp);
+}
+void task_yield() { uint32_t f = irq_save(); schedule(); irq_restore(f); }
+void task_preempt() { if (need_resched && sched_running && !irq_depth) task_yield(); }
+void task_block(uint8_t why) { task_current->state = TASK_BLOCKED; task_current->wait = why; schedule(); task_current->wait = WAIT_NONE; } // IF=0
+void task_wake(Task* t) {
+    if (!t) return;
+    uint32_t f = irq_save(); if (t->state == TASK_BLOCKED && t->wait == WAIT_EVENT) run_push(t); irq_restore(f);
+    task_preempt();
+}
+void task_start() { sti(); task_current->entry(task_current->arg); cli(); task_block(WAIT_NONE); } // a task that returns is parked for good
+Task* task_create(const char* name, uint8_t prio, void (*entry)(void*), void* arg) {
+    Task* t = kmalloc(sizeof(Task)); uint8_t* stack = kmalloc(TASK_STACK_SIZE);
+    if (!t || !stack) { kfree(t); kfree(stack); return NULL; }
+    memset(t, 0, sizeof(Task)); t->name = name; t->prio = t->base_prio = prio; t->entry = entry; t->arg = arg;
+    uintptr_t* sp = (uintptr_t*)(stack + TASK_STACK_SIZE);
+    *--sp = (uintptr_t)task_start; for (int i = 0; i < 4; i++) *--sp = 0; // ebp, ebx, esi, edi for switch_context to pop
+    t->esp = (uintptr_t)sp;
+    uint32_t f = irq_save(); run_push(t); irq_restore(f);
+    return t;
+}
+void sched_tick() { // PIT IRQ
+    task_current->runtime_ms++;
+    if (--task_current->slice == 0) { task_current->slice = TASK_SLICE_MS; if (run_head[task_current->prio]) need_resched = true; }
+}
+volatile bool timers_due = false;
+void timer_poll() { // PIT IRQ: wake the timer task only when the wheel may have work for this millisecond
+    uint32_t now = clock_ms;
+    if (timer_count && (tw0[now & (TW0_SIZE-1)] || tw0[(now - 1) & (TW0_SIZE-1)] || !(now & (TW0_SIZE-1)))) { timers_due = true; task_wake(sys_task); }
+}
+
+void mutex_lock(Mutex* m) {
+    uint32_t f = irq_save(); Task* t = task_current;
+    if (m->owner == t) { m->depth++; irq_restore(f); return; }
+    while (m->owner) {
+        Task* o = m->owner; // priority inheritance: the holder runs at our priority until it lets go
+        if (o->prio > t->prio) { if (o->state == TASK_READY) { run_remove(o); o->prio = t->prio; run_push(o); } else o->prio = t->prio; }
+        Task** l = &m->waiters; while (*l) l = &(*l)->next;
+        *l = t; t->next = NULL; task_block(WAIT_MUTEX);
+        if (m->owner == t) { irq_restore(f); return; } // mutex_unlock() handed it to us
+    }
+    m->owner = t; m->depth = 1; t->locks_held++; irq_restore(f);
+}
+void mutex_unlock(Mutex* m) {
+    uint32_t f = irq_save(); Task* t = task_current;
+    if (--m->depth == 0) {
+        m->owner = NULL; if (--t->locks_held == 0) t->prio = t->base_prio;
+        Task* w = m->waiters;
+        if (w) { // the first waiter owns it before anyone else can take it, and inherits from those still waiting
+            m->waiters = w->next; m->owner = w; m->depth = 1; w->locks_held++;
+            for (Task* x = m->waiters; x; x = x->next) if (x->prio < w->prio) w->prio = x->prio;
+            run_push(w);
+        }
+    }
+    irq_restore(f); task_preempt();
+}
+
+bool msg_send(Task* t, int type, int a, int b) { // never blocks: safe from IRQs and timers, drops when the queue is full (senders that must not lose anything check msg_room() first)
+    if (!t) return false;
+    uint32_t f = irq_save(); bool ok = t->msg_head - t->msg_tail < MSG_QUEUE_SIZE;
+    if (ok) t->msgs[t->msg_head++ & (MSG_QUEUE_SIZE-1)] = (Msg){ type, a, b }; else t->msg_dropped++;
+    irq_restore(f); task_wake(t);
+    return ok;
+}
+Msg msg_recv() {
+    uint32_t f = irq_save(); Task* t = task_current;
+    while (t->msg_head == t->msg_tail) task_block(WAIT_EVENT);
+    Msg m = t->msgs[t->msg_tail++ & (MSG_QUEUE_SIZE-1)]; Task* w = t->room_waiter; t->room_waiter = NULL; irq_restore(f);
+    task_wake(w);
+    return m;
+}
+bool msg_room(Task* t, uint32_t n) { return !t || MSG_QUEUE_SIZE - (t->msg_head - t->msg_tail) >= n; }
+void msg_wait_room(Task* t, uint32_t n) { // one waiter per queue; never call it holding a lock the receiver needs
+    uint32_t f = irq_save();
+    while (!msg_room(t, n)) { t->room_waiter = task_current; task_block(WAIT_EVENT); }
+    irq_restore(f);
+}
+
+/* --- 3d. PROFILER (RDTSC ZONES) AND COM1 TELEMETRY --- */
+/* PROF_ZONE(z) times the rest of the enclosing block with the TSC and files the sample under zone z
+ * on the way out (gcc's cleanup attribute), so early returns are counted too. Zones measure wall
+ * time: a task preempted inside one is charged for the wait. Counters cover one reporting
+ * interval; prof_report() moves them to prof_last once a second and streams them over COM1. */
+#define COM1 0x3F8
+#define PROF_BUCKETS 12 // histogram bucket b: under 2^(b+1) us (the last one takes everything above)
+enum { PZ_FRAME, PZ_SWAP, PZ_LATENCY, PZ_INPUT, PZ_FS_SAVE, PZ_FS_SYNC, PZ_WIN, PZ_COUNT = PZ_WIN + 6 }; // PZ_WIN + window id - 1
+typedef struct { const char* name; uint32_t count; uint64_t total, min, max; uint32_t hist[PROF_BUCKETS]; } ProfZone; // times in TSC cycles
+ProfZone prof_zones[PZ_COUNT] = {
+    [PZ_FRAME] = {.name = "frame"}, [PZ_SWAP] = {.name = "swap"}, [PZ_LATENCY] = {.name = "latency"}, [PZ_INPUT] = {.name = "input"},
+    [PZ_FS_SAVE] = {.name = "fs_save"}, [PZ_FS_SYNC] = {.name = "fs_sync"},
+    [PZ_WIN] = {.name = "notepad"}, [PZ_WIN + 1] = {.name = "calc"}, [PZ_WIN + 2] = {.name = "settings"}, [PZ_WIN + 3] = {.name = "paint"}, [PZ_WIN + 4] = {.name = "explorer"}, [PZ_WIN + 5] = {.name = "snake"},
+};
+ProfZone prof_last[PZ_COUNT]; // the last complete interval, for the overlay
+typedef struct { int zone; uint64_t start; } ProfScope;
+volatile uint64_t prof_input_tsc = 0; // arrival of the oldest input not yet on screen, 0 = none (input-to-photon latency)
+bool prof_overlay = false, serial_ok = false;
+Spinlock prof_lock; // zones are recorded from every CPU (section 3e)
+
+static inline uint32_t tsc_to_us(uint64_t cycles) { return tsc_khz >= 1000 ? (uint32_t)(cycles / (tsc_khz / 1000)) : 0; }
+void prof_record(int z, uint64_t cycles) {
+    ProfZone* p = &prof_zones[z]; uint32_t us = tsc_to_us(cycles); int b = 0;
+    while (b < PROF_BUCKETS - 1 && us >= (2u << b)) b++;
+    uint32_t f = irq_save(); spin_lock(&prof_lock);
+    if (!p->count || cycles < p->min) p->min = cycles;
+    if (cycles > p->max) p->max = cycles;
+    p->count++; p->total += cycles; p->hist[b]++;
+    spin_unlock(&prof_lock); irq_restore(f);
+}
+static inline ProfScope prof_begin(int z) { return (ProfScope){ z, rdtsc() }; }
+static inline void prof_end(ProfScope* s) { prof_record(s->zone, rdtsc() - s->start); }
+#define PROF_ZONE(z) ProfScope prof_scope __attribute__((cleanup(prof_end))) = prof_begin(z)
+
+void serial_init() { // 115200 8N1, FIFOs on, polled
+    outb(COM1 + 1, 0x00); outb(COM1 + 3, 0x80); outb(COM1 + 0, 0x01); outb(COM1 + 1, 0x00); outb(COM1 + 3, 0x03); outb(COM1 + 2, 0xC7); outb(COM1 + 4, 0x03);
+    serial_ok = inb(COM1 + 5) != 0xFF; // a floating bus reads all ones: no UART
+}
+void serial_write(const char* s) {
+    if (!serial_ok) return;
+    for (; *s; s++) { uint32_t spins = 0; while (!(inb(COM1 + 5) & 0x20) && ++spins < 100000) {} outb(COM1, *s); }
+}
+bool serial_read(char* c) { if (!serial_ok || !(inb(COM1 + 5) & 0x01)) return false; *c = inb(COM1); return true; } // polled, never waits
+/* Boot timeline: each stage logs when it finished, in microseconds since kernel_main started,
+ * as "boot stage=<name> us=<t>" on COM1 (the UART is set up first thing). */
+#define BOOT_STAGES 16
+typedef struct { const char* name; uint32_t us; } BootStage;
+BootStage boot_stages[BOOT_STAGES]; int boot_stage_count = 0;
+uint64_t boot_tsc0;
+void boot_stage(const char* name) {
+    uint32_t us = tsc_to_us(rdtsc() - boot_tsc0); char line[64];
+    if (boot_stage_count < BOOT_STAGES) boot_stages[boot_stage_count++] = (BootStage){ name, us };
+    char* e = fmt_str(line, "boot stage="); e = fmt_str(e, name); e = fmt_str(e, " us="); e = fmt_uint(e, us); fmt_str(e, "\n"); serial_write(line);
+}
+// One line per active zone: "prof t=<ms> zone=<name> n=<count> min=<us> avg=<us> max=<us> hist=<b0>,...,<b11>".
+void prof_report() {
+    char line[160];
+    for (int z = 0; z < PZ_COUNT; z++) {
+        uint32_t f = irq_save(); spin_lock(&prof_lock); ProfZone p = prof_zones[z]; prof_last[z] = p;
+        prof_zones[z].count = 0; prof_zones[z].total = prof_zones[z].max = 0; memset(prof_zones[z].hist, 0, sizeof(p.hist)); spin_unlock(&prof_lock); irq_restore(f);
+        if (!p.count || !serial_ok) continue;
+        char* e = fmt_str(line, "prof t="); e = fmt_uint(e, clock_ms); e = fmt_str(e, " zone="); e = fmt_str(e, p.name); e = fmt_str(e, " n="); e = fmt_uint(e, p.count);
+        e = fmt_str(e, " min="); e = fmt_uint(e, tsc_to_us(p.min)); e = fmt_str(e, " avg="); e = fmt_uint(e, tsc_to_us(p.total / p.count)); e = fmt_str(e, " max="); e = fmt_uint(e, tsc_to_us(p.max));
+        e = fmt_str(e, " hist="); for (int b = 0; b < PROF_BUCKETS; b++) { if (b) *e++ = ','; e = fmt_uint(e, p.hist[b]); }
+        fmt_str(e, "\n"); serial_write(line);
+    }
+}
+
+/* --- 3e. SMP: ACPI MADT, AP STARTUP, PER-CPU DATA, WORK STEALING --- */
+/* Tasks all run on the boot CPU; application processors (APs) only run jobs: short functions that
+ * never block, allocate or take a Mutex, and only write memory no other job of their group
+ * touches. Each CPU owns a deque of jobs: the submitter pushes and pops at the bottom of its own,
+ * idle CPUs steal from the top of others. A JobGroup counts unfinished jobs, and job_wait() runs
+ * jobs itself until the count drops to zero, so with one CPU the same code just runs serially.
+ * Each CPU reaches its Cpu through %gs, a segment based on it. */
+#define MAX_CPUS 16
+#define JOB_QUEUE 64         // per CPU, power of two
+#define AP_TRAMPOLINE 0x8000 // boot.s's real-mode AP entry is copied here; the SIPI vector is its page number
+#define AP_STACK_SIZE 8192
+#define SMP_COPY_CHUNK 16384 // smaller copies are not worth handing out
+typedef struct { volatile uint32_t pending; } JobGroup;
+typedef struct { void (*fn)(void*); void* arg; JobGroup* group; } Job;
+typedef struct Cpu {
+    struct Cpu* self; // %gs:0
+    uint32_t index; uint8_t apic_id;
+    volatile bool online, idle;
+    Spinlock lock; Job jobs[JOB_QUEUE]; uint32_t top, bottom; // thieves take jobs[top], the owner works at bottom
+    uint32_t jobs_run, steals;
+    Rect gfx_clip; int gfx_layer; // section 4: drawing state is per CPU so screen bands render in parallel
+} Cpu;
+Cpu cpus[MAX_CPUS] = { [0] = { .self = &cpus[0], .gfx_clip = { 0, 0, TEXT_W, TEXT_H }, .gfx_layer = -1 } };
+volatile uint32_t cpu_count = 1;   // online CPUs, cpus[0] is the boot CPU
+volatile uint32_t smp_workers = 1; // CPUs that take jobs: cpus[0, smp_workers)
+uint8_t madt_apic_ids[MAX_CPUS]; int madt_cpus = 0; // enabled processors, the boot CPU included
+uintptr_t ap_stacks[MAX_CPUS];     // boot.s: the n-th AP to arrive starts on ap_stacks[n] as cpus[n + 1]
+volatile uint32_t ap_next = 0;     // boot.s: arrival counter
+extern uint8_t ap_trampoline[], ap_trampoline_end[]; // boot.s
+uint64_t cpu_gdt[3 + MAX_CPUS];    // flat code and data as in boot.s, then one %gs segment per CPU
+struct __attribute__((packed)) { uint16_t limit; uint32_t base; } cpu_gdt_ptr;
+
+#ifdef HOSTED
+static inline Cpu* this_cpu() { return &cpus[0]; }
+static inline void cpu_load(Cpu* c) { (void)c; }
+#else
+static inline Cpu* this_cpu() { Cpu* c; asm volatile("mov %%gs:0, %0" : "=r"(c)); return c; }
+static inline void cpu_load(Cpu* c) { asm volatile("lgdt %0; mov %1, %%gs" : : "m"(cpu_gdt_ptr), "r"((3 + c->index) * 8) : "memory"); }
+#endif
+uint64_t gdt_entry(uint32_t base, uint32_t limit, uint8_t access, uint8_t flags) {
+    return (limit & 0xFFFF) | (uint64_t)(base & 0xFFFFFF) << 16 | (uint64_t)access << 40 | (uint64_t)((limit >> 16) & 0xF) << 48 | (uint64_t)flags << 52 | (uint64_t)(base >> 24) << 56;
+}
+void cpu_init(uint32_t i) { // before cpu_load() on that CPU
+    Cpu* c = &cpus[i]; c->self = c; c->index = i; c->gfx_clip = (Rect){ 0, 0, SCREEN_W, SCREEN_H }; c->gfx_layer = -1;
+    cpu_gdt[1] = 0x00CF9A000000FFFF; cpu_gdt[2] = 0x00CF92000000FFFF;
+    cpu_gdt[3 + i] = gdt_entry((uint32_t)(uintptr_t)c, sizeof(Cpu) - 1, 0x92, 0x4); // data, 32-bit, byte granular
+    cpu_gdt_ptr.limit = sizeof(cpu_gdt) - 1; cpu_gdt_ptr.base = (uint32_t)(uintptr_t)cpu_gdt;
+}
+
+bool job_push(Cpu* c, Job j) {
+    uint32_t f = irq_save(); spin_lock(&c->lock);
+    bool ok = c->bottom - c->top < JOB_QUEUE; if (ok) c->jobs[c->bottom++ % JOB_QUEUE] = j;
+    spin_unlock(&c->lock); irq_restore(f); return ok;
+}
+bool job_take(Cpu* c, Job* j, bool steal) { // the owner takes the newest job, a thief the oldest
+    if (__atomic_load_n(&c->bottom, __ATOMIC_RELAXED) == __atomic_load_n(&c->top, __ATOMIC_RELAXED)) return false; // rechecked under the lock
+    uint32_t f = irq_save(); spin_lock(&c->lock);
+    bool ok = c->bottom != c->top; if (ok) *j = steal ? c->jobs[c->top++ % JOB_QUEUE] : c->jobs[--c->bottom % JOB_QUEUE];
+    spin_unlock(&c->lock); irq_restore(f); return ok;
+}
+bool job_run_one(Cpu* c) {
+    Job j; bool got = job_take(c, &j, false);
+    for (uint32_t k = 1; !got && k < cpu_count; k++) if ((got = job_take(&cpus[(c->index + k) % cpu_count], &j, true))) c->steals++;
+    if (!got) return false;
+    j.fn(j.arg); c->jobs_run++; __atomic_sub_fetch(&j.group->pending, 1, __ATOMIC_RELEASE);
+    return true;
+}
+bool jobs_queued() { for (uint32_t i = 0; i < cpu_count; i++) if (__atomic_load_n(&cpus[i].bottom, __ATOMIC_RELAXED) != __atomic_load_n(&cpus[i].top, __ATOMIC_RELAXED)) return true; return false; }
+void job_submit(JobGroup* g, void (*fn)(void*), void* arg) {
+    __atomic_add_fetch(&g->pending, 1, __ATOMIC_RELAXED);
+    if (smp_workers > 1 && job_push(this_cpu(), (Job){ fn, arg, g })) return;
+    fn(arg); __atomic_sub_fetch(&g->pending, 1, __ATOMIC_RELEASE); // one CPU, or the deque is full
+}
+void job_wait(JobGroup* g) {
+    Cpu* c = this_cpu(); if (!g->pending) return;
+    __atomic_thread_fence(__ATOMIC_SEQ_CST); // pairs with ap_main(): either the AP sees the jobs or we see it idle
+    uint32_t wake = __atomic_load_n(&c->bottom, __ATOMIC_RELAXED) - __atomic_load_n(&c->top, __ATOMIC_RELAXED); // one idle AP per queued job: IPIs are costly, above all under TCG
+    for (uint32_t i = 1; wake && i < smp_workers && i < cpu_count; i++) if (cpus[i].idle) { lapic_ipi(cpus[i].apic_id, VEC_WAKE); wake--; }
+    while (__atomic_load_n(&g->pending, __ATOMIC_ACQUIRE)) if (!job_run_one(c)) asm volatile("pause");
+}
+
+// Copies that do not overlap one another, spread over the workers in contiguous slices.
+typedef struct { uint8_t* dst; const uint8_t* src; uint32_t len; } Copy;
+typedef struct { const Copy* list; int n; } CopySlice;
+void copy_slice_job(void* arg) { const CopySlice* s = arg; for (int i = 0; i < s->n; i++) { const Copy* c = &s->list[i]; for (uint32_t k = 0; k < c->len; k++) c->dst[k] = c->src[k]; } }
+void smp_copy(const Copy* list, int n) {
+    int parts = imin(smp_workers, n); CopySlice slices[MAX_CPUS]; JobGroup g = { 0 };
+    if (parts <= 1) { slices[0] = (CopySlice){ list, n }; copy_slice_job(&slices[0]); return; } // not worth a job
+    for (int p = 0; p < parts; p++) { int a = n * p / parts, b = n * (p + 1) / parts; slices[p] = (CopySlice){ list + a, b - a }; job_submit(&g, copy_slice_job, &slices[p]); }
+    job_wait(&g);
+}
+void smp_memcpy(uint8_t* dst, const uint8_t* src, uint32_t len) { // dst and src must not overlap
+    int n = imax(1, imin(smp_workers, len / SMP_COPY_CHUNK)); Copy parts[MAX_CPUS];
+    for (int p = 0; p < n; p++) { uint32_t a = (uint64_t)len * p / n, b = (uint64_t)len * (p + 1) / n; parts[p] = (Copy){ dst + a, src + a, b - a }; }
+    smp_copy(parts, n);
+}
+
+/* The MADT ("APIC" table, found through the RSDP and RSDT) lists the processors, the IOAPIC and
+ * how ISA IRQs map onto IOAPIC pins. Paging is off, so the tables are read where they lie. */
+typedef struct __attribute__((packed)) { char sig[4]; uint32_t len; uint8_t rev, checksum; char oem[6], oem_table[8]; uint32_t oem_rev, creator, creator_rev; } AcpiHeader;
+volatile uint16_t* bios_ebda_seg = (volatile uint16_t*)0x40E; // BIOS data area: EBDA segment
+bool acpi_sig(const char* p, const char* sig) { for (int i = 0; sig[i]; i++) if (p[i] != sig[i]) return false; return true; }
+bool acpi_checksum(const void* p, uint32_t len) { uint8_t sum = 0; for (uint32_t i = 0; i < len; i++) sum += ((const uint8_t*)p)[i]; return sum == 0; }
+const AcpiHeader* acpi_find(const char* sig) { // the RSDP sits in the first KiB of the EBDA or in the BIOS area
+    uintptr_t ebda = (uintptr_t)*bios_ebda_seg << 4, areas[2][2] = { { ebda, ebda + 1024 }, { 0xE0000, 0x100000 } };
+    for (int r = 0; r < 2; r++) for (uintptr_t a = areas[r][0]; a && a < areas[r][1]; a += 16) {
+        if (!acpi_sig((const char*)a, "RSD PTR ") || !acpi_checksum((const void*)a, 20)) continue;
+        const AcpiHeader* rsdt = (const AcpiHeader*)(uintptr_t)*(const uint32_t*)(a + 16);
+        if (!acpi_sig(rsdt->sig, "RSDT") || !acpi_checksum(rsdt, rsdt->len)) return NULL;
+        const uint32_t* tables = (const uint32_t*)(rsdt + 1);
+        for (uint32_t i = 0; i < (rsdt->len - sizeof(AcpiHeader)) / 4; i++) {
+            const AcpiHeader* t = (const AcpiHeader*)(uintptr_t)tables[i];
+            if (acpi_sig(t->sig, sig) && acpi_checksum(t, t->len)) return t;
+        }
+        return NULL;
+    }
+    return NULL;
+}
+// Before idt_init(): enables the local APIC and moves IRQ delivery to the IOAPIC. "noapic" keeps the 8259s and one CPU.
+void smp_init() {
+    const AcpiHeader* madt = cmdline_has("noapic") ? NULL : acpi_find("APIC");
+    if (!madt) return;
+    lapic = (volatile uint32_t*)(uintptr_t)*(const uint32_t*)(madt + 1);
+    for (const uint8_t* e = (const uint8_t*)(madt + 1) + 8; e + 2 <= (const uint8_t*)madt + madt->len && e[1]; e += e[1]) {
+        if (e[0] == 0 && (*(const uint32_t*)(e + 4) & 1) && madt_cpus < MAX_CPUS) madt_apic_ids[madt_cpus++] = e[3]; // enabled processor
+        else if (e[0] == 1 && !ioapic) { ioapic = (volatile uint32_t*)(uintptr_t)*(const uint32_t*)(e + 4); ioapic_gsi_base = *(const uint32_t*)(e + 8); }
+        else if (e[0] == 2 && e[3] < 16) { isa_gsi[e[3]] = *(const uint32_t*)(e + 4); isa_flags[e[3]] = *(const uint16_t*)(e + 8); } // source override
+    }
+    bsp_apic_id = lapic_read(LAPIC_ID) >> 24; cpus[0].apic_id = bsp_apic_id; cpus[0].online = true;
+    lapic_enable();
+    if (ioapic) ioapic_init();
+}
+void ap_main(uint32_t slot) { // boot.s, on ap_stacks[slot] with IRQs off; never returns
+    Cpu* c = &cpus[slot + 1];
+    cpu_load(c); idt_load(); lapic_enable(); c->apic_id = lapic_read(LAPIC_ID) >> 24;
+    c->online = true; __atomic_add_fetch(&cpu_count, 1, __ATOMIC_SEQ_CST);
+    while (1) {
+        if (c->index < smp_workers && job_run_one(c)) continue;
+        c->idle = true; __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        cli();
+        if (c->index < smp_workers && jobs_queued()) sti();
+        else asm volatile("sti; hlt" ::: "memory"); // a wake IPI sent after the check still ends the hlt
+        c->idle = false;
+    }
+}
+// After sti(): INIT, then SIPI twice, to every other enabled processor at once, timed with the PIT. "nosmp" stays on one CPU.
+void smp_start() {
+    if (!lapic || cmdline_has("nosmp")) return;
+    uint32_t aps = 0;
+    for (int i = 0; i < madt_cpus && aps < MAX_CPUS - 1; i++) if (madt_apic_ids[i] != bsp_apic_id) {
+        uint8_t* stack = kmalloc(AP_STACK_SIZE); if (!stack) break;
+        ap_stacks[aps] = (uintptr_t)stack + AP_STACK_SIZE; cpu_init(++aps);
+    }
+    if (!aps) return;
+    uint8_t* t = (uint8_t*)(uintptr_t)AP_TRAMPOLINE; for (const uint8_t* p = ap_trampoline; p < ap_trampoline_end; p++) *t++ = *p;
+    for (int pass = 0; pass < 3; pass++) {
+        for (int i = 0, n = 0; i < madt_cpus && n < (int)aps; i++) if (madt_apic_ids[i] != bsp_apic_id) {
+            lapic_ipi(madt_apic_ids[i], pass ? 0x4600 | AP_TRAMPOLINE >> 12 : 0x4500); n++; // INIT, then SIPI
+        }
+        delay_us(pass ? 200 : 10000);
+    }
+    uint32_t t0 = clock_ms; while (cpu_count < 1 + aps && clock_ms - t0 < 100) asm volatile("pause");
+    smp_workers = cpu_count;
+}
+
 /* --- 4. GRAPHICS ENGINE --- */
+// Drawing state is per CPU, so render bands on different CPUs clip and layer independently.
+static inline Rect cpu_clip() { return this_cpu()->gfx_clip; } // all drawing is clipped to this (always inside the screen)
+static inline void cpu_set_clip(Rect r) { this_cpu()->gfx_clip = r; }
+static inline int cpu_draw_layer() { return this_cpu()->gfx_layer; } // >= 0: drawing only lands on cells whose vis_map entry matches
+static inline void cpu_set_draw_layer(int layer) { this_cpu()->gfx_layer = layer; }
+bool rect_overlaps(Rect a, Rect b) { return a.x < b.x + b.w && b.x < a.x + a.w && a.y < b.y + b.h && b.y < a.y + a.h; }
+Rect rect_union(Rect a, Rect b) { int x = imin(a.x, b.x), y = imin(a.y, b.y); return (Rect){ x, y, imax(a.x + a.w, b.x + b.w) - x, imax(a.y + a.h, b.y + b.h) - y }; }
+
 uint16_t vga_entry(unsigned char uc, uint8_t color) { return (uint16_t) uc | (uint16_t) color << 8; }
+// Next run of cells in row y, starting at or after x0 and ending before x1, that belong to the draw layer.
+// Returns the run start (x1 if none) and stores its end in *end.
+int vis_span(int y, int x0, int x1, int* end) {
+    const uint8_t* v = &vis_map[y * SCREEN_W]; int layer = cpu_draw_layer();
+    if (layer < 0) { *end = x1; return x0; }
+    while (x0 < x1 && v[x0] != layer) x0++;
+    int e = x0; while (e < x1 && v[e] == layer) e++;
+    *end = e; return x0;
+}
+// Span blitter: fills [x0, x1) of row y with e where the draw layer is visible. The caller has already clipped.
+void fill_span(int y, int x0, int x1, uint16_t e) {
+    int ex; uint16_t* row = &back_buffer[y * SCREEN_W];
+    while ((x0 = vis_span(y, x0, x1, &ex)) < x1) { for (int x = x0; x < ex; x++) row[x] = e; x0 = ex; }
+}
 void draw_rect(int x, int y, int w, int h, uint8_t bg, uint8_t fg, char fill) {
-    for (int r = 0; r < h; r++) { for (int c = 0; c < w; c++) {
-            int cx = x + c, cy = y + r;
-            if (cx >= 0 && cx < SCREEN_W && cy >= 0 && cy < SCREEN_H) back_buffer[cy * SCREEN_W + cx] = vga_entry(fill, bg << 4 | fg);
-    }}
+    Rect c = cpu_clip(); int x0 = imax(x, c.x), y0 = imax(y, c.y), x1 = imin(x + w, c.x + c.w), y1 = imin(y + h, c.y + c.h);
+    uint16_t e = vga_entry(fill, bg << 4 | fg);
+    if (x0 < x1) for (int cy = y0; cy < y1; cy++) fill_span(cy, x0, x1, e);
+}
+void put_cell(int x, int y, char ch, uint8_t attr) {
+    Rect c = cpu_clip(); if (x < c.x || x >= c.x + c.w || y < c.y || y >= c.y + c.h) return;
+    int o = y * SCREEN_W + x, layer = cpu_draw_layer(); if (layer < 0 || vis_map[o] == layer) back_buffer[o] = vga_entry(ch, attr);
 }
 void draw_text(int x, int y, const char* text, uint8_t bg, uint8_t fg) {
-    int i = 0; while (text[i] != 0) {
-        if (x+i >= 0 && x+i < SCREEN_W && y >= 0 && y < SCREEN_H) back_buffer[y * SCREEN_W + (x+i)] = vga_entry(text[i], bg << 4 | fg);
-        i++;
-    }
+    Rect c = cpu_clip(); if (y < c.y || y >= c.y + c.h) return;
+    int i = 0; while (text[i] != 0) { put_cell(x+i, y, text[i], bg << 4 | fg); i++; }
 }
 void draw_number(int x, int y, int num, uint8_t bg, uint8_t fg) {
     char buf[16]; int i = 0; if (num == 0) { buf[0] = '0'; buf[1] = 0; }
     else { int n = num; if (n < 0) n = -n; while (n > 0) { buf[i++] = (n % 10) + '0'; n /= 10; } if (num < 0) buf[i++] = '-'; buf[i] = 0; for(int j=0; j<i/2; j++) { char t = buf[j]; buf[j] = buf[i-1-j]; buf[i-1-j] = t; } }
     draw_text(x, y, buf, bg, fg);
 }
-void buffer_swap() { uint16_t* vga = (uint16_t*) VGA_ADDR; for (int i = 0; i < SCREEN_W * SCREEN_H; i++) vga[i] = back_buffer[i]; }
+
+/* LINEAR FRAMEBUFFER: with "gfx" on the command line the Bochs/QEMU VBE adapter is switched to
+ * 1024x768x32 and the cell grid grows to 128x48. Everything still draws cells; buffer_swap() turns
+ * each changed cell into an 8x16 glyph from the VGA ROM font, read out of plane 2 before the switch.
+ * Rendered glyphs are cached by (char, attr), so a swap is a lookup and 16 eight-dword copies per
+ * cell. Without the adapter the text screen stays. */
+#define VBE_INDEX 0x1CE
+#define VBE_DATA 0x1CF
+enum { VBE_ID, VBE_XRES, VBE_YRES, VBE_BPP, VBE_ENABLE, VBE_BANK, VBE_VIRT_W };
+#define VBE_ENABLED 0x01
+#define VBE_LFB 0x40
+#define LFB_DEFAULT 0xE0000000 // Bochs' fixed address, used if no PCI display answers
+#define GFX_W 1024
+#define GFX_H 768
+#define GLYPH_W 8
+#define GLYPH_H 16
+#define GLYPH_CACHE_BITS 9 // 512 glyphs, direct mapped
+bool gfx_mode = false;
+uint32_t* lfb; uint32_t lfb_pitch; // pitch in pixels
+uint8_t font[256 * GLYPH_H];
+uint32_t* glyph_cache; uint32_t* glyph_tag; // GLYPH_W * GLYPH_H pixels per slot, from arena_gfx
+uint32_t glyph_misses = 0;
+const uint32_t vga_palette[16] = { 0x000000, 0x0000AA, 0x00AA00, 0x00AAAA, 0xAA0000, 0xAA00AA, 0xAA5500, 0xAAAAAA, 0x555555, 0x5555FF, 0x55FF55, 0x55FFFF, 0xFF5555, 0xFF55FF, 0xFFFF55, 0xFFFFFF };
+
+static inline void vbe_write(uint16_t index, uint16_t val) { outw(VBE_INDEX, index); outw(VBE_DATA, val); }
+static inline uint16_t vbe_read(uint16_t index) { outw(VBE_INDEX, index); return inw(VBE_DATA); }
+uint32_t pci_read(int bus, int dev, int fn, int off) { outl(0xCF8, 0x80000000u | bus << 16 | dev << 11 | fn << 8 | (off & 0xFC)); return inl(0xCFC); }
+uintptr_t lfb_find() { // BAR0 of the QEMU/Bochs (1234:1111) or VirtualBox (80EE:BEEF) display
+    for (int dev = 0; dev < 32; dev++) { uint32_t id = pci_read(0, dev, 0, 0); if (id == 0x11111234 || id == 0xBEEF80EE) return pci_read(0, dev, 0, 0x10) & ~0xFu; }
+    return LFB_DEFAULT;
+}
+void vga_read_font() { // text mode keeps the font in plane 2; map it at 0xA0000 for a moment
+    const volatile uint8_t* vram = (const volatile uint8_t*)0xA0000;
+    outb(0x3C4, 4); uint8_t seq4 = inb(0x3C5); outb(0x3CE, 4); uint8_t gc4 = inb(0x3CF); outb(0x3CE, 5); uint8_t gc5 = inb(0x3CF); outb(0x3CE, 6); uint8_t gc6 = inb(0x3CF);
+    outb(0x3C4, 4); outb(0x3C5, 0x06); outb(0x3CE, 4); outb(0x3CF, 2); outb(0x3CE, 5); outb(0x3CF, 0); outb(0x3CE, 6); outb(0x3CF, 0x04); // planar, read plane 2, 64K at A0000
+    for (int c = 0; c < 256; c++) for (int r = 0; r < GLYPH_H; r++) font[c * GLYPH_H + r] = vram[c * 32 + r];
+    outb(0x3C4, 4); outb(0x3C5, seq4); outb(0x3CE, 4); outb(0x3CF, gc4); outb(0x3CE, 5); outb(0x3CF, gc5); outb(0x3CE, 6); outb(0x3CF, gc6);
+}
+bool vbe_init() {
+    vbe_write(VBE_ID, 0xB0C5); uint16_t id = vbe_read(VBE_ID); // we ask for the newest interface, it answers with what it has
+    if (id < 0xB0C2 || id > 0xB0C5) return false; // 32 bpp needs version 2
+    vga_read_font();
+    vbe_write(VBE_ENABLE, 0); vbe_write(VBE_XRES, GFX_W); vbe_write(VBE_YRES, GFX_H); vbe_write(VBE_BPP, 32); vbe_write(VBE_ENABLE, VBE_ENABLED | VBE_LFB);
+    if (vbe_read(VBE_XRES) != GFX_W || vbe_read(VBE_YRES) != GFX_H || vbe_read(VBE_BPP) != 32) { vbe_write(VBE_ENABLE, 0); return false; }
+    lfb = (uint32_t*)lfb_find(); lfb_pitch = vbe_read(VBE_VIRT_W);
+    gfx_mode = true; SCREEN_W = GFX_W / GLYPH_W; SCREEN_H = GFX_H / GLYPH_H;
+    return true;
+}
+const uint32_t* glyph(uint16_t cell) {
+    uint32_t slot = (cell * 2654435761u) >> (32 - GLYPH_CACHE_BITS); uint32_t* g = &glyph_cache[slot * GLYPH_W * GLYPH_H];
+    if (glyph_tag[slot] == cell) return g;
+    uint32_t fg = vga_palette[cell >> 8 & 15], bg = vga_palette[cell >> 12]; const uint8_t* f = &font[(cell & 0xFF) * GLYPH_H];
+    for (int r = 0; r < GLYPH_H; r++) for (int c = 0; c < GLYPH_W; c++) g[r * GLYPH_W + c] = (f[r] & (0x80 >> c)) ? fg : bg;
+    glyph_tag[slot] = cell; glyph_misses++; return g;
+}
+
+/* DAMAGE TRACKING: state changes call damage() for the screen area they affect. render() only
+ * repaints those rectangles and buffer_swap() only writes cells that differ from front_buffer,
+ * because every VGA MMIO write is a trap under emulation. */
+#define DIRTY_MAX 16
+Rect dirty_rects[DIRTY_MAX]; int dirty_count = 0;
+uint32_t frames_rendered = 0, cells_written = 0; // running totals
+uint64_t render_cycles = 0;                      // running total of TSC cycles spent in render()
+uint32_t stat_fps = 0, stat_cells = 0;           // per-second rates, updated by clock_step()
+
+void damage(int x, int y, int w, int h) {
+    int x0 = imax(x, 0), y0 = imax(y, 0), x1 = imin(x + w, SCREEN_W), y1 = imin(y + h, SCREEN_H);
+    if (x0 >= x1 || y0 >= y1) return;
+    task_wake(wm_task); // it renders once the damaging task drops gui_lock
+    Rect r = { x0, y0, x1 - x0, y1 - y0 }, grown = { x0 - 1, y0 - 1, x1 - x0 + 2, y1 - y0 + 2 };
+    for (int i = 0; i < dirty_count; i++) if (rect_overlaps(dirty_rects[i], grown)) { dirty_rects[i] = rect_union(dirty_rects[i], r); return; } // overlapping or touching
+    if (dirty_count < DIRTY_MAX) { dirty_rects[dirty_count++] = r; return; }
+    int best = 0, best_cost = 1 << 30; // list full: fold into the rect that grows least
+    for (int i = 0; i < dirty_count; i++) { Rect u = rect_union(dirty_rects[i], r); int cost = u.w * u.h - dirty_rects[i].w * dirty_rects[i].h; if (cost < best_cost) { best_cost = cost; best = i; } }
+    dirty_rects[best] = rect_union(dirty_rects[best], r);
+}
+void damage_all() { dirty_count = 0; damage(0, 0, SCREEN_W, SCREEN_H); }
+void gfx_init() {
+    arena_reset(&arena_gfx);
+    back_buffer = arena_alloc(&arena_gfx, SCREEN_W * SCREEN_H * 2); front_buffer = arena_alloc(&arena_gfx, SCREEN_W * SCREEN_H * 2); vis_map = arena_alloc(&arena_gfx, SCREEN_W * SCREEN_H);
+    memset(front_buffer, 0xFF, SCREEN_W * SCREEN_H * 2); // unknown VGA contents: force the first swap to write every cell
+    if (gfx_mode) { glyph_cache = arena_alloc(&arena_gfx, (GLYPH_W * GLYPH_H * 4) << GLYPH_CACHE_BITS); glyph_tag = arena_alloc(&arena_gfx, 4 << GLYPH_CACHE_BITS); memset(glyph_tag, 0xFF, 4 << GLYPH_CACHE_BITS); }
+    cpu_set_clip((Rect){ 0, 0, SCREEN_W, SCREEN_H }); damage_all();
+}
+void lfb_swap() {
+    for (int i = 0; i < dirty_count; i++) { Rect r = dirty_rects[i];
+        for (int y = r.y; y < r.y + r.h; y++) for (int x = r.x; x < r.x + r.w; x++) {
+            int o = y * SCREEN_W + x; if (front_buffer[o] == back_buffer[o]) continue;
+            front_buffer[o] = back_buffer[o]; cells_written++;
+            const uint32_t* g = glyph(back_buffer[o]); uint32_t* p = &lfb[y * GLYPH_H * lfb_pitch + x * GLYPH_W];
+            for (int row = 0; row < GLYPH_H; row++) copy32(p + row * lfb_pitch, g + row * GLYPH_W, GLYPH_W);
+        }
+    }
+}
+void buffer_swap() {
+    PROF_ZONE(PZ_SWAP);
+    uint16_t* vga = (uint16_t*) VGA_ADDR; uint32_t cells = cells_written;
+    if (gfx_mode) lfb_swap();
+    else for (int i = 0; i < dirty_count; i++) { Rect r = dirty_rects[i];
+        for (int y = r.y; y < r.y + r.h; y++) for (int x = r.x; x < r.x + r.w; x++) {
+            int o = y * SCREEN_W + x; if (front_buffer[o] != back_buffer[o]) { front_buffer[o] = back_buffer[o]; vga[o] = back_buffer[o]; cells_written++; }
+        }
+    }
+    dirty_count = 0; frames_rendered++;
+    // Latency runs from the first unshown input to the first swap after it that changes the screen.
+    uint32_t f = irq_save(); uint64_t t = prof_input_tsc; if (t && cells_written != cells) prof_input_tsc = 0; irq_restore(f);
+    if (t && cells_written != cells) prof_record(PZ_LATENCY, rdtsc() - t);
+}
 
 /* --- 5. WINDOW SYSTEM --- */
-int mouse_x = 40, mouse_y = 12; uint8_t mouse_cycle = 0; int8_t mouse_byte[3]; bool mouse_left = false;
+int mouse_x = 40, mouse_y = 12; uint8_t mouse_cycle = 0; uint8_t mouse_byte[3]; bool mouse_left = false;
 char kbd_map[128] = { 0, 27, '1', '2', '3', '4', '5', '6', '7', '8', '9', '0', '-', '=', '\b', '\t', 'q', 'w', 'e', 'r', 't', 'y', 'u', 'i', 'o', 'p', '[', ']', '\n', 0, 'a', 's', 'd', 'f', 'g', 'h', 'j', 'k', 'l', ';', '\'', '`', 0, '\\', 'z', 'x', 'c', 'v', 'b', 'n', 'm', ',', '.', '/', 0, '*', 0, ' ', 0 };
 char kbd_map_shift[128] = { 0, 27, '!', '@', '#', '$', '%', '^', '&', '*', '(', ')', '_', '+', '\b', '\t', 'Q', 'W', 'E', 'R', 'T', 'Y', 'U', 'I', 'O', 'P', '{', '}', '\n', 0, 'A', 'S', 'D', 'F', 'G', 'H', 'J', 'K', 'L', ':', '"', '~', 0, '|', 'Z', 'X', 'C', 'V', 'B', 'N', 'M', '<', '>', '?', 0, '*', 0, ' ', 0 };
 
-typedef struct { int id; int x, y, w, h; char title[20]; bool visible; int active_tab; } Window;
-Window win_notepad  = {1, 5, 3, 40, 18, "Gemini Notepad", false, 0};
-Window win_calc     = {2, 50, 5, 22, 14, "Calculator", false, 0};
-Window win_settings = {3, 15, 4, 34, 16, "Settings", false, 0}; 
-Window win_paint    = {4, 10, 2, 40, 20, "Paint", false, 0};
-Window win_files    = {5, 20, 5, 30, 15, "File Explorer", false, 0};
-Window win_snake    = {6, 25, 5, 30, 15, "Snake Game", false, 0};
-Window* windows[] = {&win_notepad, &win_calc, &win_settings, &win_paint, &win_files, &win_snake};
+typedef struct { int id; int x, y, w, h; char title[20]; bool visible; int active_tab; int z; } Window;
+Window win_notepad  = {1, 5, 3, 40, 18, "Gemini Notepad", false, 0, 1};
+Window win_calc     = {2, 50, 5, 22, 14, "Calculator", false, 0, 2};
+Window win_settings = {3, 15, 4, 34, 16, "Settings", false, 0, 3}; 
+Window win_paint    = {4, 10, 2, 40, 20, "Paint", false, 0, 4};
+Window win_files    = {5, 20, 5, 30, 15, "File Explorer", false, 0, 5};
+Window win_snake    = {6, 25, 5, 30, 15, "Snake Game", false, 0, 6};
+#define WIN_COUNT 6
+Window* windows[WIN_COUNT] = {&win_notepad, &win_calc, &win_settings, &win_paint, &win_files, &win_snake};
+
+/* Each app runs as its own task. The window manager only posts it messages (coordinates are
+ * window-relative, since the window may move before the app gets to them). */
+enum { MSG_KEY = 1, MSG_CLICK, MSG_DRAG, MSG_DRAG_END, MSG_TICK, MSG_SAVE, MSG_OPEN, MSG_SYNC };
+Task* app_tasks[WIN_COUNT + 1]; // by Window id
+void app_handle(Window* w, Msg m); // section 9
+void app_post(Window* w, int type, int a, int b) { // until the app tasks exist (and in the hosted build) the message is handled right away
+    if (app_tasks[w->id]) msg_send(app_tasks[w->id], type, a, b); else app_handle(w, (Msg){ type, a, b });
+}
+/* Apps drain their queues under gui_lock, one message at a time, so input must not overrun them
+ * while it holds the lock: update_drivers() stops before an event once some queue is short of
+ * APP_MSG_ROOM slots, and the input task waits for room with the lock released. */
+#define APP_MSG_ROOM 4 // covers what one input event can post to one app: a click and a drag, a key, an open
+Task* app_backlog() { for (int i = 1; i <= WIN_COUNT; i++) if (!msg_room(app_tasks[i], APP_MSG_ROOM)) return app_tasks[i]; return NULL; }
 Window* drag_win = NULL; Window* resize_win = NULL; int drag_off_x = 0, drag_off_y = 0; bool start_open = false;
+#define DIALOG_X ((SCREEN_W - 30) / 2)
+#define DIALOG_Y ((SCREEN_H - 5) / 2)
+
+// A window's footprint includes its drop shadow and any drop-down menu, which can reach past a small window (Paint "Tiny").
+Rect window_rect(Window* w) { return (Rect){ w->x, w->y, imax(w->w + 1, 25), imax(w->h + 1, 9) }; }
+void damage_window(Window* w) { Rect r = window_rect(w); damage(r.x, r.y, r.w, r.h); }
+void damage_start_menu() { damage(0, SCREEN_H - 14, 20, 14); }
+void damage_dialog() { damage(DIALOG_X, DIALOG_Y, 30, 8); }
+#define PROF_OVERLAY_W 32
+void damage_profiler() { damage(SCREEN_W - PROF_OVERLAY_W, 0, PROF_OVERLAY_W, PZ_COUNT + 1); }
+
+/* WINDOW STACK: zorder[0] is the bottom window, zorder[WIN_COUNT-1] the top one, and the topmost
+ * visible window has focus. Window::z is its 1-based position, which is what vis_map stores.
+ * The map is rebuilt lazily whenever a window moved, resized, opened, closed or changed place. */
+Window* zorder[WIN_COUNT] = {&win_notepad, &win_calc, &win_settings, &win_paint, &win_files, &win_snake};
+Rect vis_layout[WIN_COUNT]; // body rect per z-level the map was built from, empty when hidden
+int vis_count[WIN_COUNT + 1]; // visible cells per z-level
+bool vis_valid = false;
+
+void wm_update_vis() {
+    bool same = vis_valid;
+    for (int i = 0; i < WIN_COUNT; i++) {
+        Window* w = zorder[i]; Rect r = w->visible ? (Rect){ w->x, w->y, w->w, w->h } : (Rect){ 0, 0, 0, 0 };
+        if (r.x != vis_layout[i].x || r.y != vis_layout[i].y || r.w != vis_layout[i].w || r.h != vis_layout[i].h) { vis_layout[i] = r; same = false; }
+    }
+    if (same) return;
+    memset(vis_map, 0, SCREEN_W * SCREEN_H);
+    for (int i = 0; i < WIN_COUNT; i++) { Rect r = vis_layout[i];
+        for (int y = imax(r.y, 0); y < imin(r.y + r.h, SCREEN_H); y++) for (int x = imax(r.x, 0); x < imin(r.x + r.w, SCREEN_W); x++) vis_map[y * SCREEN_W + x] = i + 1;
+    }
+    for (int i = 0; i <= WIN_COUNT; i++) vis_count[i] = 0;
+    for (int o = 0; o < SCREEN_W * SCREEN_H; o++) vis_count[vis_map[o]]++;
+    vis_valid = true;
+}
+Window* wm_focus() { for (int i = WIN_COUNT - 1; i >= 0; i--) if (zorder[i]->visible) return zorder[i]; return NULL; }
+Window* wm_window_at(int x, int y) { wm_update_vis(); int z = vis_map[y * SCREEN_W + x]; return z ? zorder[z - 1] : NULL; }
+void wm_raise(Window* w) {
+    Window* old = wm_focus(); if (old == w && zorder[WIN_COUNT - 1] == w) return;
+    int i = 0; while (zorder[i] != w) i++;
+    for (; i < WIN_COUNT - 1; i++) { zorder[i] = zorder[i + 1]; zorder[i]->z = i + 1; }
+    zorder[WIN_COUNT - 1] = w; w->z = WIN_COUNT; vis_valid = false;
+    if (old && old != w) { damage_window(old); if (old == &win_paint) paint_menu = 0; if (old == &win_notepad) np_menu_open = 0; } // title colour, drop-downs close on focus loss
+    damage_window(w);
+}
+void wm_open(Window* w) { wm_raise(w); if (!w->visible) { w->visible = true; damage_window(w); } } // raised while still hidden, so the old focus is the one that loses it
+void wm_resize(Window* w, int nw, int nh) { damage_window(w); w->w = nw; w->h = nh; vis_valid = false; damage_window(w); } // old and new footprint
+void wm_close(Window* w) { damage_window(w); w->visible = false; Window* f = wm_focus(); if (f) damage_window(f); } // focus passes down: new title colour
+
+/* --- 5b. INPUT DRIVERS (IRQ1 / IRQ12) --- */
+/* The ISRs decode scancodes and mouse packets and push them into a single-producer /
+ * single-consumer ring. Both IRQs go through interrupt gates (IF=0), so they never
+ * nest and together act as one producer; the input task is the only consumer. */
+enum { EV_KEY = 1, EV_MOUSE = 2 };
+typedef struct { uint8_t type; uint8_t code; char c; uint8_t buttons; int16_t dx, dy; } Event;
+#define EVENT_RING_SIZE 256 // power of two
+Event event_ring[EVENT_RING_SIZE];
+volatile uint32_t ev_head = 0, ev_tail = 0; // head: written by ISRs only, tail: written by the input task only
+uint32_t ev_dropped = 0;
+
+void ev_push(Event e) {
+    if (ev_head - ev_tail >= EVENT_RING_SIZE) { ev_dropped++; return; }
+    event_ring[ev_head & (EVENT_RING_SIZE-1)] = e; barrier(); ev_head++;
+    if (!prof_input_tsc) prof_input_tsc = rdtsc();
+}
+bool ev_empty() { return ev_head == ev_tail; }
+enum { TRACE_OFF, TRACE_RECORD, TRACE_REPLAY };
+uint8_t trace_mode = TRACE_OFF;
+void trace_add(Event e); // section 5d
+void ev_input(Event e) { // live input from the ISRs: recorded with "record", ignored while a trace replays
+    if (trace_mode == TRACE_REPLAY) return;
+    if (trace_mode == TRACE_RECORD) trace_add(e);
+    ev_push(e);
+}
+
+/* PS/2 bring-up. Every controller handshake is bounded by PS2_TIMEOUT polls, so a missing or
+ * wedged 8042 costs milliseconds instead of hanging the boot. The mouse's ACK to "enable
+ * reporting" is read here too: IRQ12 is not routed yet, and an unread byte would block the port. */
+#define PS2_DATA 0x60
+#define PS2_CMD 0x64
+#define PS2_TIMEOUT 20000 // status polls, each with an io_wait(): ~20 ms
+enum { DEV_ABSENT, DEV_READY };
+uint8_t kbd_state = DEV_ABSENT, mouse_state = DEV_ABSENT;
+bool ps2_wait(uint8_t mask, uint8_t want) { for (uint32_t i = 0; i < PS2_TIMEOUT; i++) { if ((inb(PS2_CMD) & mask) == want) return true; io_wait(); } return false; }
+bool ps2_write(uint16_t port, uint8_t val) { if (!ps2_wait(0x02, 0)) return false; outb(port, val); return true; } // input buffer empty
+bool ps2_read(uint8_t* val) { if (!ps2_wait(0x01, 0x01)) return false; *val = inb(PS2_DATA); return true; } // output buffer full
+void ps2_flush() { for (int i = 0; i < 32 && (inb(PS2_CMD) & 0x01); i++) inb(PS2_DATA); }
+void ps2_init() {
+    if (inb(PS2_CMD) == 0xFF) return; // floating bus, no controller
+    uint8_t cfg;
+    if (!ps2_write(PS2_CMD, 0xAD) || !ps2_write(PS2_CMD, 0xA7)) return; // both ports off while we reconfigure
+    ps2_flush();
+    if (!ps2_write(PS2_CMD, 0x20) || !ps2_read(&cfg)) return;
+    if (!ps2_write(PS2_CMD, 0x60) || !ps2_write(PS2_DATA, (cfg | 0x03) & ~0x30)) return; // IRQ1 + IRQ12 on, both clocks on
+    if (ps2_write(PS2_CMD, 0xAE)) kbd_state = DEV_READY;
+    mouse_cycle = 0;
+    if (!ps2_write(PS2_CMD, 0xA8) || !ps2_write(PS2_CMD, 0xD4) || !ps2_write(PS2_DATA, 0xF4)) return;
+    uint8_t ack; // a key pressed meanwhile can come first
+    for (int i = 0; i < 4 && mouse_state != DEV_READY && ps2_read(&ack); i++) if (ack == 0xFA) mouse_state = DEV_READY;
+}
+void kbd_irq() {
+    uint8_t scancode = inb(0x60);
+    if (scancode == 0x2A || scancode == 0x36) shift_pressed = true;
+    else if (scancode == 0xAA || scancode == 0xB6) shift_pressed = false;
+    else if (!(scancode & 0x80)) ev_input((Event){ EV_KEY, scancode, shift_pressed ? kbd_map_shift[scancode] : kbd_map[scancode], 0, 0, 0 });
+}
+void mouse_irq() {
+    uint8_t b = inb(0x60);
+    if (mouse_cycle == 0 && !(b & 0x08)) return; // bit 3 is always set in byte 0: resync on bytes that cannot start a packet
+    mouse_byte[mouse_cycle++] = b;
+    if (mouse_cycle < 3) return;
+    mouse_cycle = 0;
+    if (mouse_byte[0] & 0xC0) return; // overflow, packet is garbage
+    int dx = mouse_byte[1] - ((mouse_byte[0] << 4) & 0x100), dy = mouse_byte[2] - ((mouse_byte[0] << 3) & 0x100); // 9-bit two's complement
+    ev_input((Event){ EV_MOUSE, 0, 0, mouse_byte[0] & 0x07, dx, dy });
+}
+void irq_handler(uint32_t irq) {
+    if ((irq == 7 || irq == 15) && ioapic_mode) return; // not routed through the IOAPIC: a masked 8259 raising a spurious IRQ
+    if (irq == 7 || irq == 15) { // spurious IRQs: only EOI the master for a spurious slave IRQ
+        outb(irq == 7 ? PIC1_CMD : PIC2_CMD, 0x0B); if (!(inb(irq == 7 ? PIC1_CMD : PIC2_CMD) & 0x80)) { if (irq == 15) outb(PIC1_CMD, 0x20); return; }
+    }
+    irq_depth++;
+    if (irq == 0) { pit_irq(); sched_tick(); timer_poll(); }
+    else if (irq == 1) { kbd_irq(); task_wake(input_task); }
+    else if (irq == 12) { mouse_irq(); task_wake(input_task); }
+    pic_eoi(irq); irq_depth--;
+    if (need_resched && sched_running) schedule(); // preempt on the way out; we resume here when switched back
+}
+
+/* --- 5c. ATA DISK (PIO, primary master) AND BUFFER CACHE --- */
+#define ATA_IO 0x1F0
+#define ATA_CTRL 0x3F6
+#define ATA_SR_ERR 0x01
+#define ATA_SR_DRQ 0x08
+#define ATA_SR_DF 0x20
+#define ATA_SR_BSY 0x80
+#define ATA_TIMEOUT 1000000
+uint32_t ata_sectors = 0; // 0 = no usable disk, everything stays in RAM
+
+bool ata_wait(bool drq) {
+    for (uint32_t i = 0; i < ATA_TIMEOUT; i++) {
+        uint8_t st = inb(ATA_IO + 7);
+        if (st & ATA_SR_BSY) continue;
+        if (st & (ATA_SR_ERR | ATA_SR_DF)) return false;
+        if (!drq || (st & ATA_SR_DRQ)) return true;
+    }
+    return false;
+}
+bool ata_idle() { for (uint32_t i = 0; i < ATA_TIMEOUT; i++) if (!(inb(ATA_IO + 7) & ATA_SR_BSY)) return true; return false; } // ERR/DF from the last command clear with the next
+void ata_delay() { for (int i = 0; i < 4; i++) inb(ATA_CTRL); } // ~400 ns for the status register to settle
+void ata_init() {
+    outb(ATA_CTRL, 0x02); // nIEN: we poll, no IRQ14
+    if (inb(ATA_IO + 7) == 0xFF) return; // floating bus, no controller
+    outb(ATA_IO + 6, 0xA0); ata_delay();
+    outb(ATA_IO + 2, 0); outb(ATA_IO + 3, 0); outb(ATA_IO + 4, 0); outb(ATA_IO + 5, 0);
+    outb(ATA_IO + 7, 0xEC); // IDENTIFY
+    if (inb(ATA_IO + 7) == 0 || inb(ATA_IO + 4) || inb(ATA_IO + 5) || !ata_wait(true)) return; // absent, or ATAPI/SATA signature
+    uint16_t id[256]; insw(ATA_IO, id, 256);
+    ata_sectors = id[60] | (uint32_t)id[61] << 16; // LBA28 addressable sectors
+}
+// One PIO command for `count` (1..256) consecutive sectors; each sector is transferred to/from its own 512-byte buffer.
+bool ata_rw(uint32_t lba, int count, uint8_t** bufs, bool write) {
+    if (!ata_idle()) return false;
+    outb(ATA_IO + 6, 0xE0 | ((lba >> 24) & 0x0F)); outb(ATA_IO + 2, count & 0xFF);
+    outb(ATA_IO + 3, lba & 0xFF); outb(ATA_IO + 4, (lba >> 8) & 0xFF); outb(ATA_IO + 5, (lba >> 16) & 0xFF);
+    outb(ATA_IO + 7, write ? 0x30 : 0x20); // WRITE SECTORS / READ SECTORS
+    for (int i = 0; i < count; i++) {
+        ata_delay(); if (!ata_wait(true)) return false;
+        if (write) outsw(ATA_IO, bufs[i], 256); else insw(ATA_IO, bufs[i], 256);
+    }
+    if (write) { outb(ATA_IO + 7, 0xE7); if (!ata_wait(false)) return false; } // CACHE FLUSH
+    return true;
+}
+
+/* Buffer cache: BCACHE_SIZE sector buffers on an LRU list with a hash on LBA. Misses read ahead
+ * up to BCACHE_READAHEAD sectors in one command. Writes only mark buffers dirty; bcache_flush()
+ * sorts the dirty set by LBA and writes each contiguous run with a single command. */
+#define BCACHE_SIZE 64
+#define BCACHE_HASH 64
+#define BCACHE_READAHEAD 8
+typedef struct Buf { uint32_t lba; bool valid, dirty; struct Buf *prev, *next, *hash_next; uint8_t data[512]; } Buf;
+Buf bcache[BCACHE_SIZE];
+Mutex disk_lock; // the buffer cache and the ATA channel
+Buf* bcache_hash[BCACHE_HASH];
+Buf bcache_lru; // sentinel: lru.next is most recently used, lru.prev the eviction candidate
+uint32_t bcache_hits = 0, bcache_misses = 0, bcache_writes = 0;
+
+void bcache_init() {
+    bcache_lru.next = bcache_lru.prev = &bcache_lru;
+    for (int i = 0; i < BCACHE_SIZE; i++) { Buf* b = &bcache[i]; b->next = bcache_lru.next; b->prev = &bcache_lru; bcache_lru.next->prev = b; bcache_lru.next = b; }
+}
+void bcache_touch(Buf* b) { b->prev->next = b->next; b->next->prev = b->prev; b->next = bcache_lru.next; b->prev = &bcache_lru; bcache_lru.next->prev = b; bcache_lru.next = b; }
+Buf* bcache_lookup(uint32_t lba) { for (Buf* b = bcache_hash[lba % BCACHE_HASH]; b; b = b->hash_next) if (b->lba == lba) return b; return NULL; }
+void bcache_unhash(Buf* b) { if (!b->valid) return; Buf** p = &bcache_hash[b->lba % BCACHE_HASH]; while (*p != b) p = &(*p)->hash_next; *p = b->hash_next; b->valid = false; }
+void bcache_flush() {
+    Buf* dirty[BCACHE_SIZE]; int n = 0;
+    for (int i = 0; i < BCACHE_SIZE; i++) if (bcache[i].valid && bcache[i].dirty) dirty[n++] = &bcache[i];
+    for (int i = 1; i < n; i++) { Buf* t = dirty[i]; int j = i; while (j > 0 && dirty[j-1]->lba > t->lba) { dirty[j] = dirty[j-1]; j--; } dirty[j] = t; }
+    for (int i = 0; i < n; ) {
+        uint8_t* run[BCACHE_SIZE]; int len = 0;
+        while (i + len < n && dirty[i + len]->lba == dirty[i]->lba + len) { run[len] = dirty[i + len]->data; len++; }
+        if (ata_rw(dirty[i]->lba, len, run, true)) for (int k = 0; k < len; k++) dirty[i + k]->dirty = false;
+        bcache_writes++; i += len;
+    }
+}
+Buf* bcache_victim() { for (Buf* b = bcache_lru.prev; b != &bcache_lru; b = b->prev) if (!b->dirty) return b; return NULL; }
+int bcache_clean() { int n = 0; for (int i = 0; i < BCACHE_SIZE; i++) n += !bcache[i].dirty; return n; }
+Buf* bcache_claim(uint32_t lba) { // recycle the least recently used clean buffer for `lba`, NULL if the disk refused every write
+    if (bcache_lru.prev->dirty) bcache_flush(); // write-back happens in batches, never one evicted sector at a time
+    Buf* b = bcache_victim(); if (!b) return NULL; // a buffer whose write failed keeps its data for the next flush
+    bcache_unhash(b); b->lba = lba; b->dirty = false; b->valid = true;
+    b->hash_next = bcache_hash[lba % BCACHE_HASH]; bcache_hash[lba % BCACHE_HASH] = b; bcache_touch(b);
+    return b;
+}
+// The returned buffer stays valid until the next bcache_get(). With read=false the caller overwrites the whole sector.
+// NULL means the sector could not be read, or no buffer could be freed because writes are failing.
+Buf* bcache_get(uint32_t lba, bool read) {
+    Buf* b = bcache_lookup(lba);
+    if (b) { bcache_hits++; bcache_touch(b); return b; }
+    bcache_misses++;
+    if (!read) return bcache_claim(lba);
+    if (bcache_lru.prev->dirty) bcache_flush();
+    int n = 1, clean = bcache_clean(); if (!clean) return NULL;
+    while (n < BCACHE_READAHEAD && n < clean && lba + n < ata_sectors && !bcache_lookup(lba + n)) n++; // each claim takes a different clean buffer
+    Buf* run[BCACHE_READAHEAD]; uint8_t* data[BCACHE_READAHEAD];
+    for (int i = n - 1; i >= 0; i--) { run[i] = bcache_claim(lba + i); data[i] = run[i]->data; } // claimed last = most recent: the requested sector
+    if (!ata_rw(lba, n, data, false)) { for (int i = 0; i < n; i++) bcache_unhash(run[i]); return NULL; } // never cache a failed read
+    return run[0];
+}
+
+/* --- 5d. INPUT TRACES: RECORD AND REPLAY --- */
+/* "record" on the command line streams every decoded input event over COM1, one line each:
+ *   trace <ms> k <scancode> <char>            key press
+ *   trace <ms> m <buttons> <dx> <dy>          mouse packet
+ * with <ms> counted from the login screen. The same text is what "replay" plays back, from the
+ * first multiboot module (-initrd) or, without one, read from COM1 up to a "trace end" line.
+ * Other lines are skipped, so a captured serial log replays as it is. The events go into the
+ * event ring as if the ISRs had decoded them, so they take the same update_drivers() ->
+ * handle_key() / mouse_apply() / handle_click() paths as live input. "replay" keeps the recorded
+ * timing, "replayfast" sends the next event as soon as the previous one is on screen. */
+#define TRACE_RING 4096          // recorded events waiting for the UART, power of two
+#define TRACE_SERIAL_PAGES 256   // 1 MiB for a trace read from COM1
+#define TRACE_SERIAL_WAIT_MS 30000 // for the first byte
+#define TRACE_SERIAL_IDLE_MS 2000  // silence that ends a trace without a "trace end" line
+typedef struct { uint32_t ms; Event e; } TraceRec;
+TraceRec trace_ring[TRACE_RING];
+volatile uint32_t trace_head = 0, trace_tail = 0; // head: ISRs, tail: the prof task
+uint32_t trace_dropped = 0, trace_t0 = 0;        // trace_t0: clock_ms when the login screen came up
+const char *trace_src = NULL, *trace_end = NULL;  // replay text not yet played
+bool trace_fast = false;
+Task* replay_task = NULL;
+
+void trace_add(Event e) { // IF=0, from the ISRs
+    if (trace_head - trace_tail >= TRACE_RING) { trace_dropped++; return; }
+    trace_ring[trace_head & (TRACE_RING-1)] = (TraceRec){ current_state == STATE_BOOT ? 0 : clock_ms - trace_t0, e }; barrier(); trace_head++;
+}
+void trace_flush() { // drains what was recorded since the last call to COM1
+    char line[64];
+    while (trace_tail != trace_head) {
+        TraceRec r = trace_ring[trace_tail & (TRACE_RING-1)]; barrier(); trace_tail++;
+        char* e = fmt_str(line, "trace "); e = fmt_uint(e, r.ms);
+        if (r.e.type == EV_KEY) { e = fmt_str(e, " k "); e = fmt_uint(e, r.e.code); e = fmt_str(e, " "); e = fmt_uint(e, (uint8_t)r.e.c); }
+        else { e = fmt_str(e, " m "); e = fmt_uint(e, r.e.buttons); e = fmt_str(e, " "); e = fmt_int(e, r.e.dx); e = fmt_str(e, " "); e = fmt_int(e, r.e.dy); }
+        fmt_str(e, "\n"); serial_write(line);
+    }
+}
+void trace_init(uint32_t magic, const MultibootInfo* mb) { // modules sit below pmm_bitmap, so pmm_init() has already kept them out of the free pool
+    trace_mode = cmdline_has("record") ? TRACE_RECORD : cmdline_has("replay") || cmdline_has("replayfast") ? TRACE_REPLAY : TRACE_OFF;
+    trace_fast = cmdline_has("replayfast");
+    if (trace_mode != TRACE_REPLAY || magic != MULTIBOOT_MAGIC || !(mb->flags & (1 << 3)) || !mb->mods_count) return;
+    const MultibootModule* m = (const MultibootModule*)(uintptr_t)mb->mods_addr;
+    trace_src = (const char*)(uintptr_t)m->start; trace_end = (const char*)(uintptr_t)m->end;
+}
+void trace_load_serial() { // polled with interrupts on and the scheduler not yet running: clock_ms ticks, nothing else reads COM1
+    char* buf = serial_ok ? pmm_alloc(TRACE_SERIAL_PAGES) : NULL; if (!buf) return;
+    uint32_t n = 0, last = clock_ms, wait = TRACE_SERIAL_WAIT_MS, line = 0; char c;
+    while (n < TRACE_SERIAL_PAGES * PAGE_SIZE && clock_ms - last < wait) {
+        if (!serial_read(&c)) { asm volatile("pause"); continue; }
+        buf[n++] = c; last = clock_ms; wait = TRACE_SERIAL_IDLE_MS;
+        if (c != '\n') continue;
+        if (has_prefix(buf + line, buf + n, "trace end")) break;
+        line = n;
+    }
+    trace_src = buf; trace_end = buf + n;
+}
+// Parses the next event line. Returns false at the end of the text or at "trace end".
+bool trace_next(TraceRec* r) {
+    while (trace_src < trace_end) {
+        const char* p = trace_src; const char* eol = p; while (eol < trace_end && *eol != '\n') eol++;
+        trace_src = eol < trace_end ? eol + 1 : eol;
+        if (!has_prefix(p, eol, "trace ")) continue;
+        p += 6; if (has_prefix(p, eol, "end")) { trace_src = trace_end; return false; }
+        int32_t ms, a, b, c = 0;
+        if (!(p = parse_int(p, eol, &ms))) continue;
+        while (p < eol && *p == ' ') p++;
+        if (p >= eol) continue;
+        char kind = *p++;
+        if (!(p = parse_int(p, eol, &a)) || !(p = parse_int(p, eol, &b))) continue;
+        if (kind == 'k') r->e = (Event){ EV_KEY, a, (char)b, 0, 0, 0 };
+        else if (kind == 'm' && parse_int(p, eol, &c)) r->e = (Event){ EV_MOUSE, 0, 0, a, b, c };
+        else continue;
+        r->ms = ms; return true;
+    }
+    return false;
+}
+uint32_t screen_checksum() { // FNV-1a over every cell on screen
+    uint32_t h = 2166136261u; const uint8_t* p = (const uint8_t*)front_buffer;
+    for (uint32_t i = 0; i < (uint32_t)SCREEN_W * SCREEN_H * 2; i++) h = (h ^ p[i]) * 16777619u;
+    return h;
+}
 
 /* --- 6. FILE SYSTEM --- */
-void fs_save(const char* name, const char* content, bool is_img) {
-    int len = is_img ? 1200 : 512;
-    for(int i=0; i<10; i++) { if(ram_disk[i].used && streq(ram_disk[i].name, name)) { for(int j=0; j<len; j++) ram_disk[i].content[j] = content[j]; ram_disk[i].is_image = is_img; return; } }
-    for(int i=0; i<10; i++) { if(!ram_disk[i].used) { strcpy_safe(ram_disk[i].name, name, 16); for(int j=0; j<len; j++) ram_disk[i].content[j] = content[j]; ram_disk[i].is_image = is_img; ram_disk[i].used = true; return; } }
+/* Files are single extents of 512-byte blocks in ram_disk, so fs_view() can hand out a direct
+ * pointer to the data. Names are found through a hash of (parent, name); directories keep a
+ * doubly-linked child list. A view stays valid until the next fs_write() or fs_compact(). */
+
+/* Persistence: with a disk attached the RAM store mirrors it. LBA 0 holds the superblock, then
+ * the raw node table, then one sector per ram_disk block. Block data is faulted in through the
+ * buffer cache on first use; changes are tracked per block / node-table sector and written back
+ * by fs_sync(). */
+#define FS_MAGIC 0x53464D47 // "GMFS"
+#define FS_NODE_LBA 1
+#define FS_NODE_SECTORS ((FS_MAX_NODES * sizeof(FsNode) + 511) / 512)
+#define FS_DATA_LBA (FS_NODE_LBA + FS_NODE_SECTORS)
+typedef struct { uint32_t magic, block_size, blocks, max_nodes, node_size; } FsSuper;
+bool fs_persistent = false, fs_super_dirty = false;
+uint32_t* fs_resident;                  // block holds valid data in ram_disk (bitmaps sized like fs_bitmap)
+uint32_t* fs_dirty;                     // block differs from disk
+uint32_t fs_node_dirty[(FS_NODE_SECTORS + 31) / 32];
+uint32_t fs_dirty_count = 0;
+
+void fs_touch_node(int n) {
+    if (!fs_persistent) return;
+    uint32_t first = n * sizeof(FsNode) / 512, last = ((n + 1) * sizeof(FsNode) - 1) / 512;
+    for (uint32_t i = first; i <= last; i++) if (!bit_test(fs_node_dirty, i)) { bit_set(fs_node_dirty, i); fs_dirty_count++; }
+}
+void fs_touch_blocks(uint32_t start, uint32_t count) {
+    for (uint32_t b = start; b < start + count; b++) { bit_set(fs_resident, b); if (fs_persistent && !bit_test(fs_dirty, b)) { bit_set(fs_dirty, b); fs_dirty_count++; } }
+}
+void fs_fault_in(int n) {
+    FsNode* f = &fs_nodes[n];
+    for (uint32_t b = f->start; b < f->start + f->nblocks; b++) if (!bit_test(fs_resident, b)) {
+        mutex_lock(&disk_lock); Buf* buf = bcache_get(FS_DATA_LBA + b, true);
+        for (int i = 0; i < FS_BLOCK_SIZE; i++) ram_disk[b * FS_BLOCK_SIZE + i] = buf ? buf->data[i] : 0;
+        mutex_unlock(&disk_lock); if (buf) bit_set(fs_resident, b); // a read error shows zeros and is retried next time
+    }
+}
+
+uint32_t fs_name_hash(int parent, const char* name) { uint32_t h = 2166136261u ^ parent; while (*name) { h ^= (uint8_t)*name++; h *= 16777619u; } return h & (FS_HASH_SIZE-1); }
+static inline uint32_t fs_map_bytes() { return (fs_blocks + 31) / 32 * 4; }
+void fs_init() { // the store takes a quarter of free RAM, halved until it fits in one piece
+    arena_reset(&arena_fs);
+    uint32_t blocks = mem_free_bytes() / 4 / FS_BLOCK_SIZE; fs_blocks = blocks < FS_MIN_BLOCKS ? FS_MIN_BLOCKS : blocks > FS_MAX_BLOCKS ? FS_MAX_BLOCKS : blocks & ~31u;
+    while (!(ram_disk = arena_alloc(&arena_fs, fs_blocks * FS_BLOCK_SIZE)) && fs_blocks > FS_MIN_BLOCKS) fs_blocks /= 2;
+    fs_bitmap = arena_alloc(&arena_fs, fs_map_bytes()); fs_resident = arena_alloc(&arena_fs, fs_map_bytes()); fs_dirty = arena_alloc(&arena_fs, fs_map_bytes());
+    memset(fs_nodes, 0, sizeof(fs_nodes)); memset(fs_hash, 0, sizeof(fs_hash));
+    fs_nodes[0].type = FS_DIR; strcpy_safe(fs_nodes[0].name, "/", FS_NAME_LEN);
+    fs_free_node = 1; for (int i = 1; i < FS_MAX_NODES - 1; i++) fs_nodes[i].next_sibling = i + 1;
+    fs_free_blocks = fs_blocks; fs_cwd = 0; fs_version++;
+    memset(fs_resident, 0xFF, fs_map_bytes()); // a fresh store is authoritative: nothing to fault in
+}
+int fs_lookup(int dir, const char* name) {
+    for (int n = fs_hash[fs_name_hash(dir, name)]; n; n = fs_nodes[n].hash_next) if (fs_nodes[n].parent == dir && streq(fs_nodes[n].name, name)) return n;
+    return -1;
+}
+int fs_create(int dir, const char* name, int type) {
+    int n = fs_lookup(dir, name); if (n >= 0) return n;
+    if (!fs_free_node || fs_nodes[dir].type != FS_DIR || !name[0]) return -1;
+    n = fs_free_node; fs_free_node = fs_nodes[n].next_sibling;
+    FsNode* f = &fs_nodes[n]; FsNode* d = &fs_nodes[dir];
+    memset(f, 0, sizeof(*f)); strcpy_safe(f->name, name, FS_NAME_LEN); f->type = type; f->parent = dir;
+    uint32_t h = fs_name_hash(dir, f->name); f->hash_next = fs_hash[h]; fs_hash[h] = n;
+    f->prev_sibling = d->last_child; if (d->last_child) fs_nodes[d->last_child].next_sibling = n; else d->first_child = n; d->last_child = n; d->child_count++;
+    fs_touch_node(n); fs_touch_node(dir); fs_touch_node(f->prev_sibling);
+    fs_version++; damage_window(&win_files); return n;
+}
+
+// Block bitmap: find `count` contiguous free blocks (first fit, skipping full words), -1 if none.
+int fs_find_run(uint32_t count) {
+    uint32_t run = 0;
+    for (uint32_t b = 0; b < fs_blocks; b++) {
+        if ((b & 31) == 0 && fs_bitmap[b >> 5] == 0xFFFFFFFF) { run = 0; b += 31; continue; }
+        if (fs_bitmap[b >> 5] & (1u << (b & 31))) run = 0; else if (++run == count) return b + 1 - count;
+    }
+    return -1;
+}
+void fs_mark(uint32_t start, uint32_t count, bool used) {
+    for (uint32_t b = start; b < start + count; b++) { if (used) fs_bitmap[b >> 5] |= 1u << (b & 31); else fs_bitmap[b >> 5] &= ~(1u << (b & 31)); }
+    if (used) fs_free_blocks -= count; else fs_free_blocks += count;
+}
+void fs_move(uint8_t* dst, const uint8_t* src, uint32_t len) {
+    if (dst + len <= src || src + len <= dst) { smp_memcpy(dst, src, len); return; } // disjoint: split across CPUs
+    if (dst < src) { for (uint32_t i = 0; i < len; i++) dst[i] = src[i]; } else if (dst > src) { while (len--) dst[len] = src[len]; } }
+// Slide every extent down to the start of the disk so all free space is one run. Only runs when a write cannot find a hole.
+uint16_t fs_order[FS_MAX_NODES];
+void fs_compact() {
+    int count = 0; uint32_t next = 0;
+    for (int i = 1; i < FS_MAX_NODES; i++) if (fs_nodes[i].type > FS_DIR && fs_nodes[i].nblocks) { fs_order[count++] = i; if (fs_persistent) fs_fault_in(i); }
+    for (int gap = count / 2; gap > 0; gap /= 2) for (int i = gap; i < count; i++) { // shell sort by extent start
+        uint16_t t = fs_order[i]; int j = i; while (j >= gap && fs_nodes[fs_order[j - gap]].start > fs_nodes[t].start) { fs_order[j] = fs_order[j - gap]; j -= gap; } fs_order[j] = t;
+    }
+    for (int i = 0; i < count; i++) { FsNode* f = &fs_nodes[fs_order[i]];
+        if (f->start != next) { fs_move(&ram_disk[next * FS_BLOCK_SIZE], &ram_disk[f->start * FS_BLOCK_SIZE], f->nblocks * FS_BLOCK_SIZE); f->start = next; fs_touch_blocks(next, f->nblocks); fs_touch_node(fs_order[i]); }
+        next += f->nblocks;
+    }
+    memset(fs_bitmap, 0, fs_map_bytes()); fs_free_blocks = fs_blocks; fs_mark(0, next, true);
+}
+bool fs_write(int n, const void* data, uint32_t len) {
+    FsNode* f = &fs_nodes[n]; uint32_t need = (len + FS_BLOCK_SIZE - 1) / FS_BLOCK_SIZE;
+    if (f->type <= FS_DIR) return false;
+    if (need > f->nblocks) { // grow in place when the blocks behind the extent are free, otherwise relocate
+        uint32_t b = f->start + f->nblocks; while (b < f->start + need && b < fs_blocks && f->nblocks && !(fs_bitmap[b >> 5] & (1u << (b & 31)))) b++;
+        if (f->nblocks && b == f->start + need) fs_mark(f->start + f->nblocks, need - f->nblocks, true);
+        else {
+            if (need > fs_free_blocks + f->nblocks) return false;
+            fs_mark(f->start, f->nblocks, false); f->nblocks = 0; f->size = 0;
+            int start = fs_find_run(need); if (start < 0) { fs_compact(); start = fs_find_run(need); }
+            if (start < 0) return false;
+            f->start = start; fs_mark(start, need, true);
+        }
+    } else if (need < f->nblocks) fs_mark(f->start + need, f->nblocks - need, false);
+    f->nblocks = need; f->size = len; damage_window(&win_files);
+    fs_touch_node(n); fs_touch_blocks(f->start, need);
+    fs_move(&ram_disk[f->start * FS_BLOCK_SIZE], data, len); // memmove semantics: a same-size rewrite from the file's own view is allowed
+    return true;
+}
+const uint8_t* fs_view(int n, uint32_t* len) {
+    if (n <= 0 || fs_nodes[n].type <= FS_DIR) { *len = 0; return NULL; }
+    if (fs_persistent) fs_fault_in(n);
+    *len = fs_nodes[n].size; return &ram_disk[fs_nodes[n].start * FS_BLOCK_SIZE];
+}
+int fs_save(int dir, const char* name, const void* data, uint32_t len, int type) {
+    PROF_ZONE(PZ_FS_SAVE);
+    int n = fs_create(dir, name, type); if (n < 0 || fs_nodes[n].type == FS_DIR) return -1;
+    fs_nodes[n].type = type; return fs_write(n, data, len) ? n : -1;
 }
-void fs_load_paint(const char* name) {
-    for(int i=0; i<10; i++) { if(ram_disk[i].used && streq(ram_disk[i].name, name)) { for(int j=0; j<1200; j++) paint_canvas[j] = (uint8_t)ram_disk[i].content[j]; strcpy_safe(paint_filename, ram_disk[i].name, 16); win_paint.visible=true; return; } }
+// Files, and directories once they are empty: the blocks go back to the bitmap, the node to the free list.
+bool fs_delete(int n) {
+    FsNode* f = &fs_nodes[n];
+    if (n <= 0 || n == fs_cwd || f->type == FS_FREE || (f->type == FS_DIR && f->child_count)) return false;
+    uint16_t* l = &fs_hash[fs_name_hash(f->parent, f->name)]; while (*l != n) l = &fs_nodes[*l].hash_next; *l = f->hash_next;
+    FsNode* d = &fs_nodes[f->parent];
+    if (f->prev_sibling) fs_nodes[f->prev_sibling].next_sibling = f->next_sibling; else d->first_child = f->next_sibling;
+    if (f->next_sibling) fs_nodes[f->next_sibling].prev_sibling = f->prev_sibling; else d->last_child = f->prev_sibling;
+    d->child_count--; fs_touch_node(f->parent); fs_touch_node(f->prev_sibling); fs_touch_node(f->next_sibling);
+    if (f->type != FS_DIR && f->nblocks) fs_mark(f->start, f->nblocks, false);
+    memset(f, 0, sizeof(*f)); f->next_sibling = fs_free_node; fs_free_node = n; fs_touch_node(n);
+    fs_version++; damage_window(&win_files); return true;
+}
+
+/* Returns false when the disk is there but cannot be read, or holds a store larger than fits in
+ * RAM here: the store then stays in RAM and the disk is never written. Runs at boot, while the
+ * store is still empty, so fs_blocks may shrink to what the disk or its image holds. */
+// A node from disk is only followed once its links stay inside fs_nodes and its extent inside the store.
+bool fs_node_sane(const FsNode* f) {
+    if (f->type == FS_FREE) return true;
+    if (f->type > FS_IMAGE || f->name[FS_NAME_LEN - 1]) return false;
+    if (f->parent >= FS_MAX_NODES || f->first_child >= FS_MAX_NODES || f->last_child >= FS_MAX_NODES || f->next_sibling >= FS_MAX_NODES || f->prev_sibling >= FS_MAX_NODES) return false;
+    return f->type == FS_DIR || (f->start <= fs_blocks && f->nblocks <= fs_blocks - f->start && f->size <= f->nblocks * FS_BLOCK_SIZE);
+}
+bool fs_mount() {
+    if (ata_sectors < FS_DATA_LBA + FS_MIN_BLOCKS) return true; // no disk, or too small to hold a store
+    Buf* super = bcache_get(0, true); if (!super) return false; // unreadable is not blank: formatting it would wipe it
+    FsSuper sb = *(FsSuper*)super->data;
+    bool ours = sb.magic == FS_MAGIC && sb.block_size == FS_BLOCK_SIZE && sb.max_nodes == FS_MAX_NODES && sb.node_size == sizeof(FsNode) && sb.blocks && FS_DATA_LBA + sb.blocks <= ata_sectors;
+    if (ours && sb.blocks > fs_blocks) return false;
+    uint32_t room = (ata_sectors - FS_DATA_LBA) & ~31u;
+    fs_blocks = ours ? sb.blocks : fs_blocks < room ? fs_blocks : room; fs_free_blocks = fs_blocks; fs_persistent = true;
+    if (!ours) {
+        fs_super_dirty = true; // blank or foreign disk: write the current store out as a fresh image on the next sync
+        for (int n = 0; n < FS_MAX_NODES; n++) { fs_touch_node(n); if (fs_nodes[n].type > FS_DIR && fs_nodes[n].nblocks) fs_touch_blocks(fs_nodes[n].start, fs_nodes[n].nblocks); }
+        return true;
+    }
+    uint8_t* raw = (uint8_t*)fs_nodes;
+    for (uint32_t i = 0; i < FS_NODE_SECTORS; i++) {
+        Buf* b = bcache_get(FS_NODE_LBA + i, true); if (!b) { fs_persistent = false; fs_init(); return false; } // drop the partial node table
+        for (uint32_t k = 0; k < 512 && i * 512 + k < sizeof(fs_nodes); k++) raw[i * 512 + k] = b->data[k];
+    }
+    bool sane = fs_nodes[0].type == FS_DIR; for (int n = 0; sane && n < FS_MAX_NODES; n++) sane = fs_node_sane(&fs_nodes[n]);
+    if (!sane) { fs_persistent = false; fs_init(); return false; } // corrupt: refuse it as if unreadable, and leave the disk alone
+    // The hash index, free node list and block bitmap are derived state: rebuild them from the node table.
+    memset(fs_hash, 0, sizeof(fs_hash)); memset(fs_bitmap, 0, fs_map_bytes()); memset(fs_resident, 0, fs_map_bytes());
+    fs_free_node = 0;
+    for (int n = FS_MAX_NODES - 1; n > 0; n--) {
+        FsNode* f = &fs_nodes[n];
+        if (f->type == FS_FREE) { f->next_sibling = fs_free_node; fs_free_node = n; continue; }
+        uint32_t h = fs_name_hash(f->parent, f->name); f->hash_next = fs_hash[h]; fs_hash[h] = n;
+        if (f->type != FS_DIR && f->nblocks) fs_mark(f->start, f->nblocks, true);
+    }
+    fs_version++; return true;
+}
+void fs_sync() {
+    // Runs in the background: changes are copied into the cache under gui_lock one cache-full at a
+    // time, and the slow disk writes happen with only disk_lock held. The cache was just flushed, so
+    // claiming buffers normally never writes; when a failed write left one dirty, a claim flushes,
+    // and the copies queued so far are made first so the flush never sends a buffer not yet filled.
+    if (!fs_persistent || !fs_dirty_count) return;
+    PROF_ZONE(PZ_FS_SYNC);
+    uint32_t b = 0, s = 0; bool more = true, stuck = false; Copy copies[BCACHE_SIZE];
+    while (more) {
+        mutex_lock(&gui_lock); mutex_lock(&disk_lock);
+        int n = 0, copied = 0; Buf* buf;
+        for (; b < fs_blocks && n < BCACHE_SIZE && !stuck; b++) if (bit_test(fs_dirty, b)) { // ascending LBAs, so the flush sees long sequential runs
+            if (bcache_lru.prev->dirty) { smp_copy(copies + copied, n - copied); copied = n; } // this claim may flush
+            if (!(buf = bcache_get(FS_DATA_LBA + b, false))) { stuck = true; break; } // the cache is full of failed writes: keep the rest dirty for the next sync
+            copies[n] = (Copy){ buf->data, &ram_disk[b * FS_BLOCK_SIZE], FS_BLOCK_SIZE }; // ram_disk cannot change while we hold gui_lock
+            buf->dirty = true; bit_clear(fs_dirty, b); fs_dirty_count--; n++;
+        }
+        smp_copy(copies + copied, n - copied);
+        const uint8_t* raw = (const uint8_t*)fs_nodes;
+        for (; s < FS_NODE_SECTORS && n < BCACHE_SIZE && !stuck; s++) if (bit_test(fs_node_dirty, s)) {
+            if (!(buf = bcache_get(FS_NODE_LBA + s, false))) { stuck = true; break; }
+            for (uint32_t k = 0; k < 512; k++) buf->data[k] = (s * 512 + k < sizeof(fs_nodes)) ? raw[s * 512 + k] : 0;
+            buf->dirty = true; bit_clear(fs_node_dirty, s); fs_dirty_count--; n++;
+        }
+        if (fs_super_dirty && n < BCACHE_SIZE && !stuck && (buf = bcache_get(0, false))) {
+            memset(buf->data, 0, 512);
+            *(FsSuper*)buf->data = (FsSuper){ FS_MAGIC, FS_BLOCK_SIZE, fs_blocks, FS_MAX_NODES, sizeof(FsNode) };
+            buf->dirty = true; fs_super_dirty = false;
+        }
+        more = !stuck && (b < fs_blocks || s < FS_NODE_SECTORS || fs_super_dirty);
+        mutex_unlock(&gui_lock);
+        bcache_flush(); mutex_unlock(&disk_lock);
+    }
+}
+void storage_sync() { fs_sync(); mutex_lock(&disk_lock); bcache_flush(); mutex_unlock(&disk_lock); }
+
+/* Explorer paging: the first node of the current page is cached, so a frame only touches the
+ * entries it shows and turning a page walks one page of siblings, never the whole directory. */
+int explorer_page = 0;
+struct { int dir, page, per_page, first; uint32_t version; } explorer_cache = { -1, 0, 0, 0, 0 };
+int explorer_pages(int per_page) { int n = fs_nodes[fs_cwd].child_count; return n ? (n + per_page - 1) / per_page : 1; }
+int explorer_page_start(int per_page) {
+    int n; bool valid = explorer_cache.dir == fs_cwd && explorer_cache.per_page == per_page && explorer_cache.version == fs_version;
+    if (valid && explorer_cache.page == explorer_page) return explorer_cache.first;
+    if (valid && explorer_cache.page + 1 == explorer_page) { n = explorer_cache.first; for (int i = 0; i < per_page && n; i++) n = fs_nodes[n].next_sibling; }
+    else if (valid && explorer_cache.page - 1 == explorer_page) { n = explorer_cache.first; for (int i = 0; i < per_page && n; i++) n = fs_nodes[n].prev_sibling; }
+    else { n = fs_nodes[fs_cwd].first_child; for (int i = 0; i < explorer_page * per_page && n; i++) n = fs_nodes[n].next_sibling; }
+    explorer_cache.dir = fs_cwd; explorer_cache.page = explorer_page; explorer_cache.per_page = per_page; explorer_cache.first = n; explorer_cache.version = fs_version;
+    return n;
+}
+void explorer_open_dir(int dir) { fs_cwd = dir; explorer_page = 0; damage_window(&win_files); }
+
+/* --- 6b. NOTEPAD TEXT ENGINE --- */
+/* The text is a gap buffer with the gap at the cursor, so typing and deleting are O(1) and moving
+ * the cursor costs the distance moved. The line index is gapped the same way: starts of lines up
+ * to the cursor line are stored from the top of the text, the rest as distances from the end,
+ * so neither half changes when text is inserted or removed at the cursor. */
+uint32_t np_len() { return np_cap - (np_gap_end - np_gap); }
+char np_char(uint32_t i) { return np_buf[i < np_gap ? i : i + (np_gap_end - np_gap)]; }
+uint32_t np_line_count() { return np_line_gap + (np_max_lines - np_line_gap_end); }
+uint32_t np_line_start(uint32_t l) { return l < np_line_gap ? np_lines[l] : np_len() - np_lines[l + (np_line_gap_end - np_line_gap)]; }
+uint32_t np_line_end(uint32_t l) { return l + 1 < np_line_count() ? np_line_start(l + 1) - 1 : np_len(); } // excludes the '\n'
+uint32_t np_cur_line() { return np_line_gap - 1; }
+void np_move(uint32_t pos) {
+    uint32_t len = np_len(); if (pos > len) pos = len;
+    if (pos < np_gap) { uint32_t n = np_gap - pos; fs_move((uint8_t*)&np_buf[np_gap_end - n], (uint8_t*)&np_buf[pos], n); np_gap -= n; np_gap_end -= n; }
+    else if (pos > np_gap) { uint32_t n = pos - np_gap; fs_move((uint8_t*)&np_buf[np_gap], (uint8_t*)&np_buf[np_gap_end], n); np_gap += n; np_gap_end += n; }
+    while (np_line_gap > 1 && np_lines[np_line_gap - 1] > pos) np_lines[--np_line_gap_end] = len - np_lines[--np_line_gap];
+    while (np_line_gap_end < np_max_lines && len - np_lines[np_line_gap_end] <= pos) np_lines[np_line_gap++] = len - np_lines[np_line_gap_end++];
+}
+bool np_insert(char c) {
+    if (np_gap == np_gap_end || (c == '\n' && np_line_gap == np_line_gap_end)) return false;
+    np_buf[np_gap++] = c;
+    if (c == '\n') np_lines[np_line_gap++] = np_gap;
+    return true;
+}
+void np_backspace() { if (!np_gap) return; if (np_buf[--np_gap] == '\n') np_line_gap--; }
+void np_delete() { if (np_gap_end == np_cap) return; if (np_buf[np_gap_end++] == '\n') np_line_gap_end++; }
+void np_clear() { np_gap = 0; np_gap_end = np_cap; np_lines[0] = 0; np_line_gap = 1; np_line_gap_end = np_max_lines; np_top = np_left = 0; }
+void np_init() { // the document gets 1/16 of free RAM, between 64 KiB and 4 MiB
+    uint32_t cap = mem_free_bytes() / 16; cap = cap < 64 * 1024 ? 64 * 1024 : cap > 4 * 1024 * 1024 ? 4 * 1024 * 1024 : cap;
+    arena_reset(&arena_text);
+    np_buf = arena_alloc(&arena_text, cap); np_lines = arena_alloc(&arena_text, cap / 16 * sizeof(uint32_t));
+    np_cap = cap; np_max_lines = cap / 16; np_clear();
+}
+void np_goto(uint32_t line, uint32_t col) { // clamps to the document and to the line's length
+    if (line >= np_line_count()) line = np_line_count() - 1;
+    uint32_t s = np_line_start(line), e = np_line_end(line); np_move(s + col < e ? s + col : e);
+}
+// Saving wants the text contiguous: close the gap at the end, write, then put the cursor back.
+int np_save(int dir, const char* name) { uint32_t cur = np_gap; np_move(np_len()); int n = fs_save(dir, name, np_buf, np_gap, FS_TEXT); np_move(cur); return n; }
+void fs_load_txt(int n) {
+    if (n < 0 || fs_nodes[n].type != FS_TEXT) return;
+    uint32_t len; const char* t = (const char*)fs_view(n, &len);
+    np_clear(); for (uint32_t i = 0; i < len && np_insert(t[i]); i++); np_move(0);
+    np_dir = fs_nodes[n].parent; strcpy_safe(np_filename, fs_nodes[n].name, 16); wm_open(&win_notepad);
+}
+
+/* --- 6c. IMAGES AND PAINT TOOLS --- */
+/* Images are stored run-length encoded: an ImgHeader, a table of h row offsets, then each row as
+ * (count, colour) byte pairs covering exactly w pixels. Rows decode straight into runs, so the
+ * renderer never expands a file to pixels, and the offset table lets it start at any row.
+ * Pre-GIMG images (raw 60x20 bytes) still open. */
+#define IMG_MAX_W 256
+#define IMG_MAX_H 256
+#define IMG_LEGACY_W 60
+#define IMG_LEGACY_H 20
+typedef struct __attribute__((packed)) { char magic[4]; uint16_t w, h; } ImgHeader; // "GIMG"
+typedef struct { uint8_t len, color; } Run;
+typedef struct { int w, h; const uint8_t* raw; const uint32_t* rows; const uint8_t *rle, *end; } Image; // raw pixels, or RLE rows
+
+bool img_parse(const uint8_t* d, uint32_t len, Image* img) {
+    const ImgHeader* h = (const ImgHeader*)d;
+    bool magic = d && len >= sizeof(ImgHeader) && h->magic[0] == 'G' && h->magic[1] == 'I' && h->magic[2] == 'M' && h->magic[3] == 'G';
+    // Legacy raw pixels are colours 0-15, so they never start with the magic; a GIMG file may well be 1200 bytes.
+    if (!magic && d && len == IMG_LEGACY_W * IMG_LEGACY_H) { *img = (Image){ IMG_LEGACY_W, IMG_LEGACY_H, d, NULL, NULL, NULL }; return true; }
+    if (!magic) return false;
+    if (!h->w || !h->h || h->w > IMG_MAX_W || h->h > IMG_MAX_H || len < sizeof(ImgHeader) + h->h * 4u) return false;
+    *img = (Image){ h->w, h->h, NULL, (const uint32_t*)(d + sizeof(ImgHeader)), d + sizeof(ImgHeader) + h->h * 4, d + len };
+    return true;
+}
+int img_row(const Image* img, int y, Run* runs) { // runs for row y, covering at most img->w pixels
+    int n = 0, x = 0;
+    if (img->raw) {
+        const uint8_t* p = &img->raw[y * img->w];
+        while (x < img->w) { int e = x + 1; while (e < img->w && p[e] == p[x] && e - x < 255) e++; runs[n++] = (Run){ e - x, p[x] }; x = e; }
+        return n;
+    }
+    const uint8_t* r = img->rle + img->rows[y];
+    while (x < img->w && r >= img->rle && r + 2 <= img->end && r[0]) { int l = imin(r[0], img->w - x); runs[n++] = (Run){ l, r[1] }; x += l; r += 2; } // a damaged row just ends early
+    return n;
+}
+uint32_t img_encode(const uint8_t* px, int w, int h, uint8_t* out) { // out needs sizeof(ImgHeader) + 4h + 2wh bytes at worst
+    Image src = { w, h, px, NULL, NULL, NULL }; Run runs[IMG_MAX_W];
+    *(ImgHeader*)out = (ImgHeader){ {'G', 'I', 'M', 'G'}, w, h };
+    uint32_t* rows = (uint32_t*)(out + sizeof(ImgHeader)); uint8_t* data = (uint8_t*)&rows[h]; uint32_t o = 0;
+    for (int y = 0; y < h; y++) { rows[y] = o; int n = img_row(&src, y, runs); for (int i = 0; i < n; i++) { data[o++] = runs[i].len; data[o++] = runs[i].color; } }
+    return sizeof(ImgHeader) + h * 4 + o;
+}
+
+// Paint opens images as views: nothing is copied until the first edit materializes the data.
+void paint_new(int w, int h) {
+    paint_w = imax(1, imin(w, IMG_MAX_W)); paint_h = imax(1, imin(h, IMG_MAX_H)); paint_src = -1;
+    arena_reset(&arena_paint); paint_canvas = arena_alloc(&arena_paint, paint_w * paint_h); memset(paint_canvas, 0xFF, paint_w * paint_h);
+    damage_window(&win_paint);
+}
+void paint_image(Image* img) {
+    uint32_t len = 0; const uint8_t* d = (paint_src >= 0 && fs_nodes[paint_src].type == FS_IMAGE) ? fs_view(paint_src, &len) : NULL;
+    if (img_parse(d, len, img)) return;
+    if (paint_src >= 0) paint_src = -1; // the file is gone or no longer an image
+    *img = (Image){ paint_w, paint_h, paint_canvas, NULL, NULL, NULL };
+}
+void paint_materialize() {
+    if (paint_src < 0) return;
+    Image img; paint_image(&img); if (paint_src < 0) return;
+    Run runs[IMG_MAX_W]; paint_new(img.w, img.h); // paint_new drops the view but the image still points at the file data
+    for (int y = 0; y < img.h; y++) { uint8_t* p = &paint_canvas[y * img.w]; int n = img_row(&img, y, runs); for (int i = 0; i < n; i++) { memset(p, runs[i].color, runs[i].len); p += runs[i].len; } }
+}
+void paint_save() {
+    paint_materialize();
+    uint8_t* out = kmalloc(sizeof(ImgHeader) + paint_h * 4 + 2 * paint_w * paint_h); if (!out) return;
+    fs_save(paint_dir, paint_filename, out, img_encode(paint_canvas, paint_w, paint_h, out), FS_IMAGE); kfree(out);
+}
+void fs_load_paint(int n) {
+    uint32_t len = 0; Image img;
+    if (n < 0 || fs_nodes[n].type != FS_IMAGE) return;
+    const uint8_t* d = fs_view(n, &len); if (!img_parse(d, len, &img)) return;
+    paint_src = n; paint_dir = fs_nodes[n].parent; strcpy_safe(paint_filename, fs_nodes[n].name, 16); wm_open(&win_paint);
+}
+
+// Tools edit the canvas a horizontal span at a time and damage only the box they touched.
+Rect paint_touched; bool paint_touched_any = false;
+void paint_span(int y, int x0, int x1) { // inclusive, any order, clipped to the canvas
+    if (x0 > x1) { int t = x0; x0 = x1; x1 = t; }
+    x0 = imax(x0, 0); x1 = imin(x1, paint_w - 1); if (y < 0 || y >= paint_h || x0 > x1) return;
+    memset(&paint_canvas[y * paint_w + x0], paint_color, x1 - x0 + 1);
+    Rect r = { x0, y, x1 - x0 + 1, 1 }; paint_touched = paint_touched_any ? rect_union(paint_touched, r) : r; paint_touched_any = true;
+}
+void paint_line(int x0, int y0, int x1, int y1) { // Bresenham, emitted as one span per row
+    int dx = x1 > x0 ? x1 - x0 : x0 - x1, dy = y1 > y0 ? y0 - y1 : y1 - y0, sx = x0 < x1 ? 1 : -1, sy = y0 < y1 ? 1 : -1, err = dx + dy, run = x0;
+    while (x0 != x1 || y0 != y1) {
+        int e2 = 2 * err;
+        if (e2 <= dx) { paint_span(y0, run, x0); err += dx; y0 += sy; if (e2 >= dy) { err += dy; x0 += sx; } run = x0; }
+        else { err += dy; x0 += sx; }
+    }
+    paint_span(y0, run, x0);
+}
+void paint_fill(int x, int y) { // scanline flood fill: each stack entry seeds a whole span
+    static int16_t stack[2 * 16384]; int sp = 0;
+    if (x < 0 || y < 0 || x >= paint_w || y >= paint_h) return;
+    uint8_t old = paint_canvas[y * paint_w + x]; if (old == paint_color) return;
+    stack[sp++] = x; stack[sp++] = y;
+    while (sp) {
+        y = stack[--sp]; x = stack[--sp]; uint8_t* row = &paint_canvas[y * paint_w];
+        if (row[x] != old) continue;
+        int l = x, r = x; while (l > 0 && row[l - 1] == old) l--; while (r < paint_w - 1 && row[r + 1] == old) r++;
+        paint_span(y, l, r);
+        for (int ny = y - 1; ny <= y + 1; ny += 2) if (ny >= 0 && ny < paint_h) {
+            const uint8_t* nr = &paint_canvas[ny * paint_w];
+            for (int i = l; i <= r; i++) if (nr[i] == old && (i == l || nr[i - 1] != old) && sp < (int)(sizeof(stack) / sizeof(stack[0])) - 1) { stack[sp++] = i; stack[sp++] = ny; }
+        }
+    }
 }
-void fs_load_txt(const char* name) {
-    for(int i=0; i<10; i++) { if(ram_disk[i].used && streq(ram_disk[i].name, name)) { strcpy_safe(np_buffer, ram_disk[i].content, 512); strcpy_safe(np_filename, ram_disk[i].name, 16); np_cursor = strlen(np_buffer); win_notepad.visible = true; return; } }
+int paint_last_x = -1, paint_last_y; // stroke in progress: last pencil point, or the line's anchor
+bool paint_stroke_off = false; // the stroke began on a menu item: ignore it until the button goes up
+void paint_drag(int rx, int ry, bool end) { // window-relative position
+    int x = rx - 1, y = ry - 3; paint_materialize(); paint_touched_any = false;
+    if (paint_stroke_off) { if (end) paint_stroke_off = false; return; }
+    if (paint_last_x < 0) { paint_last_x = x; paint_last_y = y; if (paint_tool == 0) paint_span(y, x, x); else if (paint_tool == 2) paint_fill(x, y); }
+    else if (paint_tool == 0) { paint_line(paint_last_x, paint_last_y, x, y); paint_last_x = x; paint_last_y = y; }
+    if (end) { if (paint_tool == 1) paint_line(paint_last_x, paint_last_y, x, y); paint_last_x = -1; }
+    if (paint_touched_any) damage(win_paint.x + 1 + paint_touched.x, win_paint.y + 3 + paint_touched.y, paint_touched.w, paint_touched.h);
 }
 
 /* --- 7. LOGIC: SNAKE --- */
-void reset_snake() { snake_len = 3; snake_x[0]=15; snake_y[0]=8; snake_dir=1; game_over=false; }
+Timer snake_timer;
+void snake_tick(void* arg) { (void)arg; app_post(&win_snake, MSG_TICK, 0, 0); }
+/* The body is a ring of cells with an occupancy bitset beside it, so a step is one push at the head,
+ * one pop at the tail and one bit test, whatever the length. A step damages only the cells it
+ * changes, and the renderer only looks at cells inside the clip. */
+static inline void damage_snake_cell(int cell) { damage(win_snake.x + 1 + cell % snake_w, win_snake.y + 2 + cell / snake_w, 1, 1); }
+void damage_snake_score() { damage(win_snake.x + 2, win_snake.y + win_snake.h - 2, win_snake.w - 3, 1); }
+int snake_head() { return snake_ring[(snake_tail + snake_len - 1) & (SNAKE_RING - 1)]; }
+void snake_push(int cell) { snake_ring[(snake_tail + snake_len++) & (SNAKE_RING - 1)] = cell; bit_set(snake_occ, cell); }
+int snake_pop() { int cell = snake_ring[snake_tail]; snake_tail = (snake_tail + 1) & (SNAKE_RING - 1); snake_len--; bit_clear(snake_occ, cell); return cell; }
+int snake_place_food() { // a random free cell, -1 once the body fills the playfield
+    uint32_t cells = snake_w * snake_h;
+    for (int i = 0; i < 8; i++) { uint32_t c = rand_pseudo() % cells; if (!bit_test(snake_occ, c)) return c; }
+    uint32_t words = (cells + 31) / 32, start = rand_pseudo() % words; // crowded: first free bit from a random word on
+    for (uint32_t k = 0; k < words; k++) { uint32_t i = (start + k) % words; if (~snake_occ[i]) return i * 32 + __builtin_ctz(~snake_occ[i]); }
+    return -1;
+}
+void reset_snake() {
+    snake_w = imax(win_snake.w - 2, 4); snake_h = imax(win_snake.h - 4, 1);
+    uint32_t cells = snake_w * snake_h; if (cells > SNAKE_RING) { snake_h = SNAKE_RING / snake_w; cells = snake_w * snake_h; }
+    memset(snake_occ, 0, sizeof(snake_occ)); for (uint32_t c = cells; c < SNAKE_RING; c++) bit_set(snake_occ, c);
+    snake_tail = 0; snake_len = 0; int start = (snake_h / 2) * snake_w + snake_w / 2;
+    for (int i = 2; i >= 0; i--) snake_push(start - i); // three cells heading right from the middle
+    snake_dir = 1; game_over = false; snake_food = snake_place_food();
+    timer_start(&snake_timer, SNAKE_STEP_MS, SNAKE_STEP_MS, snake_tick, NULL);
+}
 void update_snake() {
-    if(!win_snake.visible || game_over) return;
-    game_tick++; if(game_tick < 3000) return; game_tick = 0;
-    for(int i=snake_len; i>0; i--) { snake_x[i] = snake_x[i-1]; snake_y[i] = snake_y[i-1]; }
-    if(snake_dir==0) snake_y[0]--; else if(snake_dir==1) snake_x[0]++; else if(snake_dir==2) snake_y[0]++; else if(snake_dir==3) snake_x[0]--;
-    if(snake_x[0] < 0 || snake_x[0] >= 28 || snake_y[0] < 0 || snake_y[0] >= 11) game_over = true;
-    for(int i=1; i<snake_len; i++) if(snake_x[0]==snake_x[i] && snake_y[0]==snake_y[i]) game_over = true;
-    if(snake_x[0] == food_x && snake_y[0] == food_y) { snake_len++; food_x = rand_pseudo() % 28; food_y = rand_pseudo() % 11; }
+    if(!win_snake.visible || game_over) { timer_cancel(&snake_timer); return; }
+    if (snake_w != win_snake.w - 2 || snake_h != win_snake.h - 4) { reset_snake(); damage_window(&win_snake); return; } // resized: new playfield, new game
+    int head = snake_head(), x = head % snake_w, y = head / snake_w;
+    if(snake_dir==0) y--; else if(snake_dir==1) x++; else if(snake_dir==2) y++; else if(snake_dir==3) x--;
+    if (x < 0 || x >= snake_w || y < 0 || y >= snake_h) { game_over = true; damage_window(&win_snake); return; }
+    int cell = y * snake_w + x; bool eat = cell == snake_food;
+    if (!eat) damage_snake_cell(snake_pop()); // the tail moves out first, so the head may follow it into its cell
+    if (bit_test(snake_occ, cell)) { game_over = true; damage_window(&win_snake); return; }
+    snake_push(cell); damage_snake_cell(cell);
+    if (eat) {
+        snake_food = snake_place_food(); damage_snake_score();
+        if (snake_food < 0) { game_over = true; damage_window(&win_snake); } else damage_snake_cell(snake_food);
+    }
 }
 
 /* --- 8. RENDERERS --- */
 void render_snake_win(Window* w) {
     int gx = w->x+1, gy = w->y+2; draw_rect(gx, gy, w->w-2, w->h-4, BLACK, GREEN, ' ');
-    if(game_over) { draw_text(gx+8, gy+5, "GAME OVER", BLACK, RED); return; }
-    for(int i=0; i<snake_len; i++) draw_text(gx + snake_x[i], gy + snake_y[i], "O", BLACK, GREEN);
-    draw_text(gx + food_x, gy + food_y, "*", BLACK, RED);
+    if(game_over) { draw_text(gx + (w->w-11)/2, gy + (w->h-4)/2, "GAME OVER", BLACK, RED); return; }
+    Rect c = cpu_clip(); int x0 = imax(c.x - gx, 0), y0 = imax(c.y - gy, 0), x1 = imin(c.x + c.w - gx, imin(snake_w, w->w-2)), y1 = imin(c.y + c.h - gy, imin(snake_h, w->h-4));
+    for (int y = y0; y < y1; y++) for (int x = x0; x < x1; x++) if (bit_test(snake_occ, y * snake_w + x)) put_cell(gx + x, gy + y, 'O', BLACK << 4 | GREEN);
+    if (snake_food >= 0 && snake_food % snake_w < w->w-2 && snake_food / snake_w < w->h-4) draw_text(gx + snake_food % snake_w, gy + snake_food / snake_w, "*", BLACK, RED);
     draw_text(w->x+2, w->y+w->h-2, "Score:", LIGHT_GREY, BLACK); draw_number(w->x+9, w->y+w->h-2, (snake_len-3)*10, LIGHT_GREY, BLACK);
 }
 
+Image render_paint_img; bool render_paint_ready = false; // parsed once by render_parallel(), so bands never fault the file in
 void render_paint(Window* w) {
     draw_rect(w->x+1, w->y+2, w->w-2, 1, LIGHT_GREY, BLACK, ' ');
     draw_text(w->x+2, w->y+2, "File", (paint_menu==1)?BLUE:LIGHT_GREY, (paint_menu==1)?WHITE:BLACK);
     draw_text(w->x+8, w->y+2, "Edit", (paint_menu==2)?BLUE:LIGHT_GREY, (paint_menu==2)?WHITE:BLACK);
     uint8_t pals[] = { BLACK, RED, GREEN, BLUE, CYAN, BROWN, YELLOW, MAGENTA, LIGHT_RED };
     for(int i=0; i<9; i++) { draw_rect(w->x + 14 + (i*2), w->y + 2, 2, 1, pals[i], pals[i], ' '); if (paint_color == pals[i]) draw_text(w->x + 14 + (i*2), w->y + 2, "^", pals[i], WHITE); }
+    const char* tools = "PLF"; for(int i=0; i<3; i++) draw_text(w->x + 33 + (i*2), w->y + 2, (char[]){ tools[i], 0 }, paint_tool==i?BLACK:LIGHT_GREY, paint_tool==i?WHITE:BLACK);
     int cx = w->x+1, cy = w->y+3, cw = w->w-2, ch = w->h-4; draw_rect(cx, cy, cw, ch, WHITE, WHITE, ' ');
-    for(int r=0; r<20; r++) for(int c=0; c<60; c++) if(r<ch && c<cw && paint_canvas[r*60+c]!=0xFF) draw_rect(cx+c, cy+r, 1, 1, paint_canvas[r*60+c], paint_canvas[r*60+c], 219);
+    // Each row is decoded into runs and each run is one span fill; clipping is worked out once per row.
+    Image img; if (render_paint_ready) img = render_paint_img; else paint_image(&img);
+    Run runs[IMG_MAX_W]; Rect c = cpu_clip();
+    int xa = imax(cx, c.x), xb = imin(cx + imin(cw, img.w), c.x + c.w);
+    for(int y=imax(cy, c.y); xa < xb && y<imin(cy + imin(ch, img.h), c.y+c.h); y++) {
+        int n = img_row(&img, y - cy, runs), x = cx;
+        for(int i=0; i<n && x<xb; x += runs[i++].len) if(runs[i].color != 0xFF) fill_span(y, imax(x, xa), imin(x + runs[i].len, xb), vga_entry(219, runs[i].color << 4 | runs[i].color));
+    }
     
-    // SOLID MENUS TO FIX GLITCHES
+    // SOLID MENUS TO FIX GLITCHES (drop-downs float above the window stack)
+    int layer = cpu_draw_layer(); cpu_set_draw_layer(-1);
     if(paint_menu == 1) { 
         draw_rect(w->x+2, w->y+3, 10, 4, WHITE, BLACK, ' '); 
         draw_rect(w->x+3, w->y+4, 10, 4, DARK_GREY, BLACK, 0); // Shadow
@@ -181,8 +1819,15 @@ void render_paint(Window* w) {
         draw_rect(w->x+8, w->y+3, 16, 5, WHITE, BLACK, ' '); 
         draw_text(w->x+9, w->y+3, "480p (4:3)", WHITE, BLACK); draw_text(w->x+9, w->y+4, "720p (16:9)", WHITE, BLACK); draw_text(w->x+9, w->y+5, "Tiny", WHITE, BLACK); draw_text(w->x+9, w->y+6, "Full", WHITE, BLACK); 
     }
+    cpu_set_draw_layer(layer);
 }
 
+// Scroll just enough to keep the cursor in view of w's text area.
+void np_follow_cursor(Window* w) {
+    int tw = w->w-2, th = w->h-4; uint32_t cl = np_cur_line(), cc = np_gap - np_lines[cl];
+    if (cl < np_top) np_top = cl; else if (cl >= np_top + th) np_top = cl - th + 1;
+    if (cc < np_left) np_left = cc; else if (cc >= np_left + tw) np_left = cc - tw + 1;
+}
 void render_notepad(Window* w) {
     draw_rect(w->x+1, w->y+2, w->w-2, 1, LIGHT_GREY, BLACK, ' ');
     draw_text(w->x+2, w->y+2, "File", (np_menu_open==1)?BLUE:LIGHT_GREY, (np_menu_open==1)?WHITE:BLACK);
@@ -190,13 +1835,17 @@ void render_notepad(Window* w) {
     draw_text(w->x+w->w-10, w->y+2, np_filename, LIGHT_GREY, DARK_GREY);
     int tx=w->x+1, ty=w->y+3, tw=w->w-2, th=w->h-4;
     draw_rect(tx, ty, tw, th, WHITE, np_bold?WHITE:LIGHT_GREY, ' ');
-    int cx=0, cy=0; for(int i=0; i<strlen(np_buffer); i++) {
-        if(cy >= th) break; if(np_buffer[i]=='\n') { cx=0; cy++; continue; }
-        draw_text(tx+cx, ty+cy, (char[]){np_buffer[i],0}, WHITE, np_bold?WHITE:BLACK); cx++; if(cx>=tw) { cx=0; cy++; }
+    uint8_t attr = WHITE << 4 | (np_bold?WHITE:BLACK);
+    np_follow_cursor(w); // then lay out only the visible lines
+    uint32_t cl = np_cur_line(), cc = np_gap - np_lines[cl];
+    for (int row = 0; row < th && np_top + row < np_line_count(); row++) {
+        uint32_t s = np_line_start(np_top + row) + np_left, e = np_line_end(np_top + row);
+        for (int col = 0; col < tw && s + col < e; col++) put_cell(tx+col, ty+row, np_char(s + col), attr);
     }
-    if(cy<th) draw_text(tx+cx, ty+cy, "_", WHITE, BLACK);
+    draw_text(tx + (cc - np_left), ty + (cl - np_top), "_", WHITE, BLACK);
     
-    // SOLID MENUS
+    // SOLID MENUS (drop-downs float above the window stack)
+    int layer = cpu_draw_layer(); cpu_set_draw_layer(-1);
     if(np_menu_open == 1) { 
         draw_rect(w->x+2, w->y+3, 10, 4, WHITE, BLACK, ' ');
         draw_rect(w->x+3, w->y+4, 10, 4, DARK_GREY, BLACK, 0); // Shadow
@@ -206,6 +1855,7 @@ void render_notepad(Window* w) {
         draw_rect(w->x+8, w->y+3, 10, 3, WHITE, BLACK, ' '); 
         draw_text(w->x+9, w->y+3, "Bold", WHITE, BLACK); draw_text(w->x+9, w->y+4, "Copy", WHITE, BLACK); draw_text(w->x+9, w->y+5, "Paste", WHITE, BLACK); 
     }
+    cpu_set_draw_layer(layer);
 }
 
 void render_settings(Window* w) { 
@@ -234,155 +1884,273 @@ void render_settings(Window* w) {
         draw_rect(w->x+8, w->y+9, 6, 1, GREEN, BLACK, ' '); draw_text(w->x+9, w->y+9, " OK ", GREEN, BLACK); 
     } 
     else { 
-        draw_text(w->x+3, w->y+5, "Gemini OS Pro", BLUE, LIGHT_GREY); draw_text(w->x+3, w->y+7, "RAM: 4096MB", LIGHT_GREY, BLACK); 
+        draw_text(w->x+3, w->y+5, "Gemini OS Pro", BLUE, LIGHT_GREY); 
+        char ram[24] = "RAM: "; char* e = fmt_uint(ram + 5, pmm_used / 256); *e++ = '/'; e = fmt_uint(e, pmm_total / 256); e[0] = 'M'; e[1] = 'B'; e[2] = 0; // 256 pages per MiB
+        draw_text(w->x+3, w->y+7, ram, LIGHT_GREY, BLACK);
         draw_text(w->x+3, w->y+8, "Ver: 2.0 Stable", LIGHT_GREY, BLACK);
-        draw_text(w->x+3, w->y+9, "Uptime:", LIGHT_GREY, BLACK); draw_number(w->x+11, w->y+9, system_ticks/10, LIGHT_GREY, BLACK);
+        draw_text(w->x+3, w->y+9, "Uptime:", LIGHT_GREY, BLACK); draw_number(w->x+11, w->y+9, clock_ms/1000, LIGHT_GREY, BLACK);
+        draw_text(w->x+3, w->y+10, "FPS:", LIGHT_GREY, BLACK); draw_number(w->x+11, w->y+10, stat_fps, LIGHT_GREY, BLACK);
+        draw_text(w->x+3, w->y+11, "Cells/s:", LIGHT_GREY, BLACK); draw_number(w->x+11, w->y+11, stat_cells, LIGHT_GREY, BLACK);
+        draw_text(w->x+3, w->y+12, "Heap KB:", LIGHT_GREY, BLACK); draw_number(w->x+11, w->y+12, (heap_bytes + (arena_gfx.pages + arena_fs.pages + arena_text.pages + arena_paint.pages) * PAGE_SIZE) / 1024, LIGHT_GREY, BLACK);
+        draw_text(w->x+3, w->y+13, gfx_mode ? "Video: 1024x768" : "Video: text", LIGHT_GREY, BLACK);
+        draw_text(w->x+20, w->y+13, "CPUs:", LIGHT_GREY, BLACK); draw_number(w->x+26, w->y+13, cpu_count, LIGHT_GREY, BLACK);
+        draw_text(w->x+3, w->y+14, "Boot ms:", LIGHT_GREY, BLACK); if (boot_stage_count) draw_number(w->x+11, w->y+14, boot_stages[boot_stage_count-1].us / 1000, LIGHT_GREY, BLACK);
+    }
+}
+// Clamps the page to the directory and returns its first entry (cached, see explorer_page_start).
+int explorer_settle(Window* w) {
+    int per_page = imax(w->h - 4, 1), pages = explorer_pages(per_page);
+    if (explorer_page >= pages) explorer_page = pages - 1;
+    return explorer_page_start(per_page);
+}
+void render_explorer(Window* w) {
+    int per_page = imax(w->h - 4, 1), pages = explorer_pages(per_page), n = explorer_settle(w);
+    draw_rect(w->x+1, w->y+2, w->w-2, 1, LIGHT_GREY, BLACK, ' ');
+    draw_text(w->x+2, w->y+2, "[Up]", LIGHT_GREY, fs_cwd ? BLACK : DARK_GREY); draw_text(w->x+7, w->y+2, "[+Dir]", LIGHT_GREY, BLACK);
+    draw_text(w->x+w->w-10, w->y+2, "<", LIGHT_GREY, explorer_page ? BLACK : DARK_GREY); draw_number(w->x+w->w-8, w->y+2, explorer_page+1, LIGHT_GREY, BLACK);
+    draw_text(w->x+w->w-3, w->y+2, ">", LIGHT_GREY, explorer_page+1 < pages ? BLACK : DARK_GREY);
+    draw_rect(w->x+1, w->y+3, w->w-2, w->h-4, WHITE, WHITE, ' ');
+    for (int i = 0; i < per_page && n; i++, n = fs_nodes[n].next_sibling) {
+        FsNode* f = &fs_nodes[n]; int fy = w->y+3+i;
+        if (f->type == FS_DIR) { draw_text(w->x+2, fy, "+", WHITE, BROWN); draw_text(w->x+4, fy, f->name, WHITE, BLACK); }
+        else { draw_text(w->x+4, fy, f->name, f->type == FS_IMAGE ? BLUE : WHITE, f->type == FS_IMAGE ? WHITE : BLACK); draw_number(w->x+w->w-8, fy, f->size, WHITE, DARK_GREY); }
+        if (f->type != FS_DIR || !f->child_count) draw_text(w->x+w->w-2, fy, "x", WHITE, RED); // delete
     }
 }
-void render_explorer(Window* w) { draw_rect(w->x+1, w->y+2, w->w-2, w->h-3, WHITE, WHITE, ' '); int fy=w->y+2; for(int i=0; i<10; i++) if(ram_disk[i].used) { draw_text(w->x+2, fy++, ram_disk[i].name, ram_disk[i].is_image?BLUE:BLACK, ram_disk[i].is_image?WHITE:WHITE); } }
 void render_calc(Window* w) { draw_rect(w->x+2, w->y+2, w->w-4, 2, WHITE, BLACK, ' '); draw_number(w->x+3, w->y+3, calc_new_entry?calc_curr:calc_acc, WHITE, BLACK); draw_text(w->x+2, w->y+5, "[7][8][9][+]", LIGHT_GREY, BLACK); draw_text(w->x+2, w->y+7, "[4][5][6][-]", LIGHT_GREY, BLACK); draw_text(w->x+2, w->y+9, "[1][2][3][*]", LIGHT_GREY, BLACK); draw_text(w->x+2, w->y+11,"[C][0][=][/]", LIGHT_GREY, BLACK); }
 
+void draw_shadow(Window* w) { // the drop shadow lands on whatever lies below w: lower windows or the desktop
+    uint16_t e = vga_entry(176, BLACK << 4 | DARK_GREY); Rect c = cpu_clip();
+    for (int y = imax(w->y+1, c.y); y < imin(w->y+1+w->h, c.y+c.h); y++) for (int x = imax(w->x+1, c.x); x < imin(w->x+1+w->w, c.x+c.w); x++)
+        if (vis_map[y*SCREEN_W+x] < w->z) back_buffer[y*SCREEN_W+x] = e;
+}
+void render_profiler() { // F12 overlay: the last second's zones, times in microseconds
+    int x = SCREEN_W - PROF_OVERLAY_W;
+    draw_rect(x, 0, PROF_OVERLAY_W, PZ_COUNT + 1, BLACK, LIGHT_GREEN, ' '); draw_text(x + 1, 0, "zone        n    avg    max", BLACK, YELLOW);
+    for (int z = 0; z < PZ_COUNT; z++) { ProfZone* p = &prof_last[z];
+        draw_text(x + 1, z + 1, prof_zones[z].name, BLACK, LIGHT_GREEN); draw_number(x + 10, z + 1, p->count, BLACK, LIGHT_GREEN);
+        if (p->count) { draw_number(x + 16, z + 1, tsc_to_us(p->total / p->count), BLACK, LIGHT_GREEN); draw_number(x + 23, z + 1, tsc_to_us(p->max), BLACK, LIGHT_GREEN); }
+    }
+}
 void draw_window(Window* w) {
-    if (!w->visible) return;
-    draw_rect(w->x+1, w->y+1, w->w, w->h, BLACK, DARK_GREY, 176); draw_rect(w->x, w->y, w->w, w->h, LIGHT_GREY, BLACK, ' '); draw_rect(w->x, w->y, w->w, 1, BLUE, WHITE, ' ');
-    draw_text(w->x+1, w->y, w->title, BLUE, WHITE); draw_text(w->x+w->w-3, w->y, "[X]", RED, WHITE); draw_text(w->x+w->w-1, w->y+w->h-1, "/", LIGHT_GREY, DARK_GREY);
+    if (!w->visible || !rect_overlaps(window_rect(w), cpu_clip())) return;
+    draw_shadow(w);
+    if (!vis_count[w->z]) return; // fully covered (never the focused window, so no drop-down can be open)
+    uint8_t title_bg = (w == wm_focus()) ? BLUE : DARK_GREY;
+    cpu_set_draw_layer(w->z);
+    draw_rect(w->x, w->y, w->w, w->h, LIGHT_GREY, BLACK, ' '); draw_rect(w->x, w->y, w->w, 1, title_bg, WHITE, ' ');
+    draw_text(w->x+1, w->y, w->title, title_bg, WHITE); draw_text(w->x+w->w-3, w->y, "[X]", RED, WHITE); draw_text(w->x+w->w-1, w->y+w->h-1, "/", LIGHT_GREY, DARK_GREY);
+    PROF_ZONE(PZ_WIN + w->id - 1);
     if (w->id == 1) render_notepad(w); else if (w->id == 2) render_calc(w); else if (w->id == 3) render_settings(w); else if (w->id == 4) render_paint(w); else if (w->id == 5) render_explorer(w); else if (w->id == 6) render_snake_win(w);
+    cpu_set_draw_layer(-1);
 }
 
 /* --- 9. INPUT LOGIC --- */
 void handle_click(int mx, int my) {
     if(show_save_dialog || show_load_dialog) {
-        int dx=25, dy=10;
+        int dx=DIALOG_X, dy=DIALOG_Y; damage_dialog();
         if(my==dy+5 && mx>=dx+2 && mx<=dx+8) { 
-            if(dialog_mode==1) { strcpy_safe(np_filename, dialog_input_buf, 16); fs_save(np_filename, np_buffer, false); }
-            if(dialog_mode==2) { strcpy_safe(paint_filename, dialog_input_buf, 16); fs_save(paint_filename, (char*)paint_canvas, true); }
-            if(dialog_mode==3) { fs_load_paint(dialog_input_buf); }
+            if(dialog_mode==1) { strcpy_safe(np_filename, dialog_input_buf, 16); np_dir = fs_cwd; app_post(&win_notepad, MSG_SAVE, 0, 0); }
+            if(dialog_mode==2) { strcpy_safe(paint_filename, dialog_input_buf, 16); paint_dir = fs_cwd; app_post(&win_paint, MSG_SAVE, 0, 0); }
+            if(dialog_mode==3) { app_post(&win_paint, MSG_OPEN, fs_lookup(fs_cwd, dialog_input_buf), 0); }
             show_save_dialog=false; show_load_dialog=false;
         }
         if(my==dy+5 && mx>=dx+10 && mx<=dx+18) { show_save_dialog=false; show_load_dialog=false; }
         return;
     }
     if (start_open) {
+        damage_start_menu();
         if (mx < 20 && my > SCREEN_H - 14) { 
             int item = (my - (SCREEN_H - 14));
-            if (item == 3) win_notepad.visible = true; else if (item == 4) win_calc.visible = true; else if (item == 5) win_paint.visible = true;
-            else if (item == 6) win_settings.visible = true; else if (item == 7) win_files.visible = true; else if (item == 8) { win_snake.visible=true; reset_snake(); }
+            Window* open = NULL;
+            if (item == 3) open = &win_notepad; else if (item == 4) open = &win_calc; else if (item == 5) open = &win_paint;
+            else if (item == 6) open = &win_settings; else if (item == 7) open = &win_files; else if (item == 8) { open = &win_snake; reset_snake(); }
             else if (item == 9) sys_reboot(); else if (item == 10) sys_shutdown();
+            if (open) wm_open(open);
             start_open = false; return;
         } else start_open = false; 
     }
-    if (my == SCREEN_H - 1 && mx < 8) { start_open = !start_open; return; }
-
-    for(int i=5; i>=0; i--) { // Reverse order for Z-index
-        Window* w = windows[i]; if (!w->visible) continue;
-        if (mx >= w->x && mx < w->x + w->w && my >= w->y && my < w->y + w->h) {
-            settings_edit_mode = 0;
-            if (mx == w->x + w->w - 1 && my == w->y + w->h - 1) { resize_win = w; return; }
-            if (my == w->y) { if (mx >= w->x + w->w - 3) { w->visible = false; return; } drag_win = w; drag_off_x = mx - w->x; drag_off_y = my - w->y; return; }
-            
-            if(w->id==4) { // Paint
-                if(my==w->y+2 && mx<w->x+6) paint_menu = (paint_menu==1)?0:1;
-                else if(my==w->y+2 && mx<w->x+12) paint_menu = (paint_menu==2)?0:2;
-                else if(my==w->y+2) { int idx=(mx-(w->x+14))/2; if(idx>=0 && idx<9) { uint8_t p[]={0,4,2,1,3,6,14,5,12}; paint_color=p[idx]; } }
-                if(paint_menu==1) { 
-                    if(my==w->y+3) { memset(paint_canvas, 0xFF, 1200); paint_menu=0; } 
-                    if(my==w->y+4) { show_load_dialog=true; dialog_mode=3; strcpy_safe(dialog_input_buf, paint_filename, 16); paint_menu=0; }
-                    if(my==w->y+5) { show_save_dialog=true; dialog_mode=2; strcpy_safe(dialog_input_buf, paint_filename, 16); paint_menu=0; }
-                }
-                if(paint_menu==2) { if(my==w->y+3) { w->w=32; w->h=14; paint_menu=0; } if(my==w->y+4) { w->w=45; w->h=16; paint_menu=0; } if(my==w->y+5) { w->w=20; w->h=10; paint_menu=0; } if(my==w->y+6) { w->w=60; w->h=20; paint_menu=0; } }
-                return;
-            }
-            if(w->id==1) { // Notepad
-                if(my==w->y+2 && mx<w->x+6) np_menu_open=(np_menu_open==1)?0:1;
-                else if(my==w->y+2 && mx<w->x+12) np_menu_open=(np_menu_open==2)?0:2;
-                if(np_menu_open==1) {
-                    if(my==w->y+3) { fs_save(np_filename, np_buffer, false); np_menu_open=0; }
-                    if(my==w->y+4) { show_save_dialog=true; dialog_mode=1; strcpy_safe(dialog_input_buf, np_filename, 16); np_menu_open=0; }
-                    if(my==w->y+5) { win_files.visible=true; np_menu_open=0; }
-                }
-                if(np_menu_open==2) { if(my==w->y+3) np_bold=!np_bold; np_menu_open=0; }
-                return;
-            }
-            if(w->id==3) { // Settings (FIXED UI)
-                if(my==w->y+2) { if(mx<w->x+7) w->active_tab=0; else if(mx<w->x+14) w->active_tab=1; else if(mx<w->x+20) w->active_tab=2; else w->active_tab=3; }
-                if(w->active_tab==0) { if(my==w->y+7 && mx<w->x+12) DESKTOP_COLOR=CYAN; if(my==w->y+7 && mx>w->x+12) DESKTOP_COLOR=BLUE; if(my==w->y+9 && mx<w->x+12) DESKTOP_COLOR=DARK_GREY; if(my==w->y+9 && mx>w->x+12) DESKTOP_COLOR=RED; }
-                if(w->active_tab==1 && my>=w->y+7 && my<=w->y+9) MOUSE_SPEED = my - (w->y+7);
-                if(w->active_tab==2) { if(my==w->y+5) settings_edit_mode=1; if(my==w->y+7) settings_edit_mode=2; if(my==w->y+9) settings_edit_mode=0; }
-            }
-            if(w->id==5 && my>w->y+1) { 
-                int idx=my-(w->y+2); 
-                if(idx>=0 && idx<10 && ram_disk[idx].used) {
-                    if(ram_disk[idx].is_image) fs_load_paint(ram_disk[idx].name);
-                    else fs_load_txt(ram_disk[idx].name);
-                }
-            }
-            if(w->id==2 && my>w->y+4) { // Calc Fixed
-                int row = (my - (w->y+5)) / 2; int col = (mx - (w->x+2)) / 4; 
-                if(row==0) { if(col==0) calc_curr=calc_curr*10+7; if(col==1) calc_curr=calc_curr*10+8; if(col==2) calc_curr=calc_curr*10+9; if(col==3) { calc_op='+'; calc_acc=calc_curr; calc_curr=0; } }
-                if(row==1) { if(col==0) calc_curr=calc_curr*10+4; if(col==1) calc_curr=calc_curr*10+5; if(col==2) calc_curr=calc_curr*10+6; if(col==3) { calc_op='-'; calc_acc=calc_curr; calc_curr=0; } }
-                if(row==2) { if(col==0) calc_curr=calc_curr*10+1; if(col==1) calc_curr=calc_curr*10+2; if(col==2) calc_curr=calc_curr*10+3; if(col==3) { calc_op='*'; calc_acc=calc_curr; calc_curr=0; } }
-                if(row==3) { 
-                    if(col==0) { calc_curr=0; calc_acc=0; } if(col==1) calc_curr=calc_curr*10+0; 
-                    if(col==2) { if(calc_op=='+') calc_curr+=calc_acc; if(calc_op=='-') calc_curr=calc_acc-calc_curr; if(calc_op=='*') calc_curr*=calc_acc; if(calc_op=='/') if(calc_curr) calc_curr=calc_acc/calc_curr; calc_new_entry=true; }
-                    if(col==3) { calc_op='/'; calc_acc=calc_curr; calc_curr=0; }
-                }
-            }
-            return;
+    if (my == SCREEN_H - 1 && mx < 8) { start_open = !start_open; damage_start_menu(); return; }
+
+    Window* w = wm_window_at(mx, my); // same visibility map the compositor draws with
+    if (w) {
+        settings_edit_mode = 0; wm_raise(w); damage_window(w);
+        if (mx == w->x + w->w - 1 && my == w->y + w->h - 1) { resize_win = w; return; }
+        if (my == w->y) { if (mx >= w->x + w->w - 3) { wm_close(w); return; } drag_win = w; drag_off_x = mx - w->x; drag_off_y = my - w->y; return; }
+        app_post(w, MSG_CLICK, mx - w->x, my - w->y);
+    }
+}
+
+// App side of a click, run by the app's task. Menus, tool bars and content are all app business.
+void app_click(Window* w, int mx, int my) {
+    if(w->id==4) { // Paint
+        if(my==w->y+2 && mx<w->x+6) paint_menu = (paint_menu==1)?0:1;
+        else if(my==w->y+2 && mx<w->x+12) paint_menu = (paint_menu==2)?0:2;
+        else if(my==w->y+2 && mx>=w->x+33 && mx<w->x+39) paint_tool = (mx-(w->x+33))/2;
+        else if(my==w->y+2) { int idx=(mx-(w->x+14))/2; if(idx>=0 && idx<9) { uint8_t p[]={0,4,2,1,3,6,14,5,12}; paint_color=p[idx]; } }
+        if(paint_menu && my>w->y+2 && my<w->y+w->h-1 && mx>w->x && mx<w->x+w->w-1) paint_stroke_off = true; // this press picks a menu item, it must not also paint
+        if(paint_menu==1) { 
+            if(my==w->y+3) { paint_new(w->w-2, w->h-4); paint_menu=0; } 
+            if(my==w->y+4) { show_load_dialog=true; damage_dialog(); dialog_mode=3; strcpy_safe(dialog_input_buf, paint_filename, 16); paint_menu=0; }
+            if(my==w->y+5) { show_save_dialog=true; damage_dialog(); dialog_mode=2; strcpy_safe(dialog_input_buf, paint_filename, 16); paint_menu=0; }
+        }
+        if(paint_menu==2) { if(my==w->y+3) { wm_resize(w, 32, 14); paint_menu=0; } if(my==w->y+4) { wm_resize(w, 45, 16); paint_menu=0; } if(my==w->y+5) { wm_resize(w, 20, 10); paint_menu=0; } if(my==w->y+6) { wm_resize(w, 60, 20); paint_menu=0; } }
+        return;
+    }
+    if(w->id==1) { // Notepad
+        if(my==w->y+2 && mx<w->x+6) np_menu_open=(np_menu_open==1)?0:1;
+        else if(my==w->y+2 && mx<w->x+12) np_menu_open=(np_menu_open==2)?0:2;
+        else if(!np_menu_open && my>w->y+2 && my<w->y+w->h-1 && mx>w->x && mx<w->x+w->w-1) { np_goto(np_top + (my-w->y-3), np_left + (mx-w->x-1)); damage_window(w); }
+        if(np_menu_open==1) {
+            if(my==w->y+3) { np_save(np_dir, np_filename); np_menu_open=0; }
+            if(my==w->y+4) { show_save_dialog=true; damage_dialog(); dialog_mode=1; strcpy_safe(dialog_input_buf, np_filename, 16); np_menu_open=0; }
+            if(my==w->y+5) { np_menu_open=0; wm_open(&win_files); }
+        }
+        if(np_menu_open==2) { if(my==w->y+3) np_bold=!np_bold; np_menu_open=0; }
+        return;
+    }
+    if(w->id==3) { // Settings (FIXED UI)
+        if(my==w->y+2) { if(mx<w->x+7) w->active_tab=0; else if(mx<w->x+14) w->active_tab=1; else if(mx<w->x+20) w->active_tab=2; else w->active_tab=3; }
+        if(w->active_tab==0) { if(my==w->y+7 && mx<w->x+12) DESKTOP_COLOR=CYAN; if(my==w->y+7 && mx>w->x+12) DESKTOP_COLOR=BLUE; if(my==w->y+9 && mx<w->x+12) DESKTOP_COLOR=DARK_GREY; if(my==w->y+9 && mx>w->x+12) DESKTOP_COLOR=RED; damage_all(); }
+        if(w->active_tab==1 && my>=w->y+7 && my<=w->y+9) MOUSE_SPEED = my - (w->y+7);
+        if(w->active_tab==2) { if(my==w->y+5) settings_edit_mode=1; if(my==w->y+7) settings_edit_mode=2; if(my==w->y+9) settings_edit_mode=0; }
+    }
+    if(w->id==5 && my==w->y+2) { // Explorer toolbar
+        int per_page = imax(w->h - 4, 1);
+        if(mx>=w->x+2 && mx<w->x+6 && fs_cwd) explorer_open_dir(fs_nodes[fs_cwd].parent);
+        if(mx>=w->x+7 && mx<w->x+13) { char name[16] = "Folder "; uint32_t k = fs_nodes[fs_cwd].child_count; do fmt_uint(name + 7, ++k); while (fs_lookup(fs_cwd, name) >= 0); fs_create(fs_cwd, name, FS_DIR); }
+        if(mx==w->x+w->w-10 && explorer_page > 0) explorer_page--;
+        if(mx==w->x+w->w-3 && explorer_page+1 < explorer_pages(per_page)) explorer_page++;
+    }
+    if(w->id==5 && my>w->y+2) {
+        int idx=my-(w->y+3), per_page = imax(w->h - 4, 1), n = explorer_page_start(per_page);
+        for (int i = 0; i < idx && n; i++) n = fs_nodes[n].next_sibling;
+        if(idx < per_page && n && mx == w->x+w->w-2) { if (paint_src == n) paint_materialize(); fs_delete(n); } // Paint may still be viewing the file
+        else if(idx < per_page && n) {
+            if(fs_nodes[n].type == FS_DIR) explorer_open_dir(n);
+            else app_post(fs_nodes[n].type == FS_IMAGE ? &win_paint : &win_notepad, MSG_OPEN, n, 0);
+        }
+    }
+    if(w->id==2 && my>w->y+4) { // Calc Fixed
+        int row = (my - (w->y+5)) / 2; int col = (mx - (w->x+2)) / 4; 
+        if(row==0) { if(col==0) calc_curr=calc_curr*10+7; if(col==1) calc_curr=calc_curr*10+8; if(col==2) calc_curr=calc_curr*10+9; if(col==3) { calc_op='+'; calc_acc=calc_curr; calc_curr=0; } }
+        if(row==1) { if(col==0) calc_curr=calc_curr*10+4; if(col==1) calc_curr=calc_curr*10+5; if(col==2) calc_curr=calc_curr*10+6; if(col==3) { calc_op='-'; calc_acc=calc_curr; calc_curr=0; } }
+        if(row==2) { if(col==0) calc_curr=calc_curr*10+1; if(col==1) calc_curr=calc_curr*10+2; if(col==2) calc_curr=calc_curr*10+3; if(col==3) { calc_op='*'; calc_acc=calc_curr; calc_curr=0; } }
+        if(row==3) { 
+            if(col==0) { calc_curr=0; calc_acc=0; } if(col==1) calc_curr=calc_curr*10+0; 
+            if(col==2) { if(calc_op=='+') calc_curr+=calc_acc; if(calc_op=='-') calc_curr=calc_acc-calc_curr; if(calc_op=='*') calc_curr*=calc_acc; if(calc_op=='/') if(calc_curr) calc_curr=calc_acc/calc_curr; calc_new_entry=true; }
+            if(col==3) { calc_op='/'; calc_acc=calc_curr; calc_curr=0; }
         }
     }
 }
 
 void handle_key(char c, uint8_t code) {
+    if (code == 0x58) { prof_overlay = !prof_overlay; damage_profiler(); return; } // F12
     if (current_state == STATE_LOGIN) {
+        damage_all();
         if (code == 0x1C) { if (streq(login_user, USERNAME) && streq(login_pass, PASSWORD)) current_state = STATE_DESKTOP; else login_user[0]=0; return; }
         if (code == 0x0F) { login_focus_pass = !login_focus_pass; return; }
         char* t = login_focus_pass ? login_pass : login_user; int l = strlen(t); if (c=='\b') { if(l>0) t[l-1]=0; } else if(l<18) { t[l]=c; t[l+1]=0; }
     } else if (current_state == STATE_DESKTOP) {
-        if(win_snake.visible && !game_over) { if(code==0x48) snake_dir=0; if(code==0x4D) snake_dir=1; if(code==0x50) snake_dir=2; if(code==0x4B) snake_dir=3; }
-        if(win_snake.visible && game_over && (c=='r' || c=='R')) reset_snake();
-        if(settings_edit_mode > 0 && c) { char* t = (settings_edit_mode == 1) ? USERNAME : PASSWORD; int l = strlen(t); if (c=='\b') { if(l>0) t[l-1]=0; } else if (l<18) { t[l]=c; t[l+1]=0; } return; }
-        if((show_save_dialog||show_load_dialog) && c) { int l = strlen(dialog_input_buf); if(c=='\b') { if(l>0) dialog_input_buf[l-1]=0; } else if(l<15) { dialog_input_buf[l]=c; dialog_input_buf[l+1]=0; } return; }
-        if(win_notepad.visible && c && !show_save_dialog) { int l = strlen(np_buffer); if(c=='\b') { if(l>0) np_buffer[l-1]=0; } else if(l<511 && c >= 32) { np_buffer[l]=c; np_buffer[l+1]=0; } else if(c=='\n') { np_buffer[l]='\n'; np_buffer[l+1]=0; } }
+        Window* focus = wm_focus();
+        if(settings_edit_mode > 0 && c) { damage_window(&win_settings); char* t = (settings_edit_mode == 1) ? USERNAME : PASSWORD; int l = strlen(t); if (c=='\b') { if(l>0) t[l-1]=0; } else if (l<18) { t[l]=c; t[l+1]=0; } return; }
+        if((show_save_dialog||show_load_dialog) && c) { damage_dialog(); int l = strlen(dialog_input_buf); if(c=='\b') { if(l>0) dialog_input_buf[l-1]=0; } else if(l<15) { dialog_input_buf[l]=c; dialog_input_buf[l+1]=0; } return; }
+        if(focus && !show_save_dialog && !show_load_dialog) app_post(focus, MSG_KEY, c, code);
+    }
+}
+void app_key(Window* w, char c, uint8_t code) {
+    if(w == &win_snake && !game_over) { if(code==0x48) snake_dir=0; if(code==0x4D) snake_dir=1; if(code==0x50) snake_dir=2; if(code==0x4B) snake_dir=3; }
+    if(w == &win_snake && game_over && (c=='r' || c=='R')) { reset_snake(); damage_window(&win_snake); }
+    if(w == &win_notepad) {
+        int page = win_notepad.h - 4; uint32_t line = np_cur_line(), col = np_gap - np_lines[line];
+        if(c=='\b') np_backspace(); else if(c=='\n' || c >= 32) np_insert(c);
+        else if(code==0x4B) np_move(np_gap ? np_gap - 1 : 0); else if(code==0x4D) np_move(np_gap + 1);
+        else if(code==0x48) { if(line) np_goto(line - 1, col); } else if(code==0x50) np_goto(line + 1, col);
+        else if(code==0x49) np_goto(line > (uint32_t)page ? line - page : 0, col); else if(code==0x51) np_goto(line + page, col);
+        else if(code==0x47) np_move(np_lines[line]); else if(code==0x4F) np_move(np_line_end(line)); else if(code==0x53) np_delete();
+        else return;
+        damage_window(&win_notepad);
     }
 }
 
+bool paint_dragging = false; // a stroke is under way: Paint gets every sample until the button goes up, wherever it is
 void update_paint_tool() {
-    if (win_paint.visible && mouse_left) {
-        int cx = win_paint.x+1, cy = win_paint.y+3, cw = win_paint.w-2, ch = win_paint.h-4;
-        if(mouse_x>=cx && mouse_x<cx+cw && mouse_y>=cy && mouse_y<cy+ch) { int lx=mouse_x-cx, ly=mouse_y-cy; if(ly<20 && lx<60) paint_canvas[ly*60+lx]=paint_color; }
-    }
+    int rx = mouse_x - win_paint.x, ry = mouse_y - win_paint.y;
+    bool in_canvas = rx >= 1 && rx < win_paint.w - 1 && ry >= 3 && ry < win_paint.h - 1 && wm_window_at(mouse_x, mouse_y) == &win_paint;
+    if (win_paint.visible && mouse_left && (paint_dragging || in_canvas)) { paint_dragging = true; app_post(&win_paint, MSG_DRAG, rx, ry); }
+    else if (paint_dragging && !mouse_left) { paint_dragging = false; app_post(&win_paint, MSG_DRAG_END, rx, ry); }
+}
+void app_handle(Window* w, Msg m) {
+    int x = w->x + m.a, y = w->y + m.b; // for window-relative positions
+    if (m.type == MSG_CLICK) app_click(w, x, y);
+    else if (m.type == MSG_KEY) app_key(w, (char)m.a, m.b);
+    else if (m.type == MSG_DRAG || m.type == MSG_DRAG_END) paint_drag(m.a, m.b, m.type == MSG_DRAG_END);
+    else if (m.type == MSG_TICK) update_snake();
+    else if (m.type == MSG_SAVE && w == &win_notepad) np_save(np_dir, np_filename);
+    else if (m.type == MSG_SAVE && w == &win_paint) paint_save();
+    else if (m.type == MSG_OPEN && w == &win_notepad) fs_load_txt(m.a);
+    else if (m.type == MSG_OPEN && w == &win_paint) fs_load_paint(m.a);
 }
 
 /* --- 10. MAIN --- */
 void render_boot(int frame) {
     draw_rect(0, 0, SCREEN_W, SCREEN_H, BLACK, BLACK, ' ');
-    draw_text(39, 10, "\x1E", CYAN, BLACK); draw_text(35, 12, "Gemini OS", WHITE, BLACK);
-    char s[] = {'|', '/', '-', '\\'}; draw_text(39, 14, (char[]){s[(frame/5)%4], 0}, DARK_GREY, BLACK);
-    buffer_swap();
+    int cx = SCREEN_W / 2, cy = SCREEN_H / 2;
+    draw_text(cx-1, cy-2, "\x1E", CYAN, BLACK); draw_text(cx-5, cy, "Gemini OS", WHITE, BLACK);
+    char s[] = {'|', '/', '-', '\\'}; draw_text(cx-1, cy+2, (char[]){s[(frame/5)%4], 0}, DARK_GREY, BLACK);
+    damage_all(); buffer_swap();
 }
 
-void render() {
-    if(show_save_dialog || show_load_dialog) {
-        int dx=25, dy=10; draw_rect(dx, dy, 30, 8, LIGHT_GREY, BLACK, ' '); draw_rect(dx, dy, 30, 1, BLUE, WHITE, ' ');
-        draw_text(dx+1, dy, show_load_dialog?"Open File...":"Save As...", BLUE, WHITE); draw_text(dx+2, dy+2, "Name:", LIGHT_GREY, BLACK);
-        draw_rect(dx+2, dy+3, 20, 1, WHITE, BLACK, ' '); draw_text(dx+2, dy+3, dialog_input_buf, WHITE, BLACK);
-        draw_rect(dx+2, dy+5, 6, 1, GREEN, BLACK, ' '); draw_text(dx+3, dy+5, " OK ", GREEN, BLACK);
-    }
-    else if (current_state == STATE_LOGIN) {
+#define BOOT_FRAMES 100
+#define BOOT_FRAME_MS 30
+Timer boot_timer, clock_timer, sync_timer; int boot_frame = 0;
+#define SYNC_MS 5000 // write-back interval for the file system
+void sync_step(void* arg) { (void)arg; msg_send(sync_task, MSG_SYNC, 0, 0); }
+/* Booting. The animation (skipped with "fastboot" on the command line) plays from the timer task
+ * while the storage task probes the disk and mounts the file system, and the login screen comes
+ * up as soon as both are done. */
+#define FAST_BOOT_POLL_MS 2
+bool fast_boot = false, storage_ready = false;
+void boot_try_login() { // gui_lock held
+    if (current_state != STATE_BOOT || !storage_ready || (!fast_boot && boot_frame < BOOT_FRAMES)) return;
+    timer_cancel(&boot_timer); current_state = STATE_LOGIN; damage_all(); task_wake(input_task);
+    trace_t0 = clock_ms; if (replay_task) msg_send(replay_task, MSG_TICK, 0, 0);
+    boot_stage("login");
+}
+void boot_step(void* arg) { (void)arg; if (!fast_boot) render_boot(boot_frame++); boot_try_login(); }
+void storage_main(void* arg) { // runs once, then parks
+    (void)arg;
+    mutex_lock(&disk_lock); bcache_init(); ata_init(); mutex_unlock(&disk_lock);
+    boot_stage(ata_sectors ? "ata" : "ata absent");
+    mutex_lock(&gui_lock); mutex_lock(&disk_lock); bool mounted = fs_mount(); mutex_unlock(&disk_lock); // files from a previously formatted disk come back here
+    storage_ready = true; boot_stage(mounted ? "mount" : "mount failed"); boot_try_login(); mutex_unlock(&gui_lock);
+}
+void clock_step(void* arg) {
+    static uint32_t last_frames = 0, last_cells = 0;
+    (void)arg; stat_fps = frames_rendered - last_frames; stat_cells = cells_written - last_cells; last_frames = frames_rendered; last_cells = cells_written;
+    if (win_settings.visible && win_settings.active_tab == 3) damage_window(&win_settings); // uptime and stats fields
+    msg_send(prof_task, MSG_TICK, 0, 0); if (prof_overlay) damage_profiler();
+}
+
+void render_scene() {
+    if (current_state == STATE_LOGIN) {
         draw_rect(0, 0, SCREEN_W, SCREEN_H, BLUE, BLUE, 177);
-        draw_rect(25, 8, 30, 10, LIGHT_GREY, BLACK, ' '); draw_rect(25, 8, 30, 1, DARK_GREY, WHITE, ' ');
-        draw_text(35, 8, "LOGIN", DARK_GREY, WHITE);
-        draw_text(27, 11, "User:", LIGHT_GREY, BLACK); 
-        draw_rect(33, 11, 20, 1, login_focus_pass?LIGHT_GREY:WHITE, login_focus_pass?LIGHT_GREY:WHITE, ' '); draw_text(33, 11, login_user, login_focus_pass?LIGHT_GREY:WHITE, BLACK);
-        draw_text(27, 13, "Pass:", LIGHT_GREY, BLACK); 
-        draw_rect(33, 13, 20, 1, login_focus_pass?WHITE:LIGHT_GREY, login_focus_pass?WHITE:LIGHT_GREY, ' '); 
-        for(int i=0; i<strlen(login_pass); i++) draw_text(33+i, 13, "*", login_focus_pass?WHITE:LIGHT_GREY, BLACK);
-        draw_text(27, 16, "Press [TAB] / [ENTER]", LIGHT_GREY, DARK_GREY);
+        int bx = (SCREEN_W - 30) / 2, by = (SCREEN_H - 9) / 2; // 25, 8 on the text screen
+        draw_rect(bx, by, 30, 10, LIGHT_GREY, BLACK, ' '); draw_rect(bx, by, 30, 1, DARK_GREY, WHITE, ' ');
+        draw_text(bx+10, by, "LOGIN", DARK_GREY, WHITE);
+        draw_text(bx+2, by+3, "User:", LIGHT_GREY, BLACK); 
+        draw_rect(bx+8, by+3, 20, 1, login_focus_pass?LIGHT_GREY:WHITE, login_focus_pass?LIGHT_GREY:WHITE, ' '); draw_text(bx+8, by+3, login_user, login_focus_pass?LIGHT_GREY:WHITE, BLACK);
+        draw_text(bx+2, by+5, "Pass:", LIGHT_GREY, BLACK); 
+        draw_rect(bx+8, by+5, 20, 1, login_focus_pass?WHITE:LIGHT_GREY, login_focus_pass?WHITE:LIGHT_GREY, ' '); 
+        for(int i=0; i<strlen(login_pass); i++) draw_text(bx+8+i, by+5, "*", login_focus_pass?WHITE:LIGHT_GREY, BLACK);
+        draw_text(bx+2, by+8, "Press [TAB] / [ENTER]", LIGHT_GREY, DARK_GREY);
     } else if (current_state == STATE_DESKTOP) {
+        cpu_set_draw_layer(0); // desktop and taskbar only show where no window covers them
         draw_rect(0, 0, SCREEN_W, SCREEN_H, DESKTOP_COLOR, DESKTOP_COLOR, 177);
         draw_rect(0, SCREEN_H-1, SCREEN_W, 1, LIGHT_GREY, BLACK, ' ');
         draw_rect(0, SCREEN_H-1, 8, 1, GREEN, BLACK, ' '); draw_text(1, SCREEN_H-1, " START ", GREEN, BLACK);
-        for(int i=0; i<6; i++) draw_window(windows[i]);
+        cpu_set_draw_layer(-1);
+        for(int i=0; i<WIN_COUNT; i++) draw_window(zorder[i]);
         if (start_open) {
             int mx = 0, my = SCREEN_H - 14; 
             draw_rect(mx, my, 20, 13, LIGHT_GREY, BLACK, ' ');
@@ -394,42 +2162,180 @@ void render() {
             draw_text(mx+2, my+9, "Restart", LIGHT_GREY, RED); draw_text(mx+2, my+10, "Shutdown", LIGHT_GREY, RED);
         }
     }
-    if (mouse_x >= 0 && mouse_x < SCREEN_W && mouse_y >= 0 && mouse_y < SCREEN_H) back_buffer[mouse_y*SCREEN_W+mouse_x] = vga_entry(0x1E, WHITE);
-    buffer_swap();
-}
-
-void update_drivers() {
-    system_ticks++;
-    uint8_t status = inb(0x64);
-    if ((status & 0x01) && (status & 0x20)) {
-        uint8_t b = inb(0x60); mouse_byte[mouse_cycle++] = b;
-        if (mouse_cycle == 3) { mouse_cycle = 0; if ((mouse_byte[0] & 0xC0) == 0) {
-            if (MOUSE_SPEED == 0) { mouse_x += mouse_byte[1]/2; mouse_y -= mouse_byte[2]/2; } else { mouse_x += mouse_byte[1]; mouse_y -= mouse_byte[2]; }
-            mouse_left = mouse_byte[0] & 1;
-            if (mouse_x < 0) mouse_x = 0; if (mouse_x >= SCREEN_W) mouse_x = SCREEN_W - 1;
-            if (mouse_y < 0) mouse_y = 0; if (mouse_y >= SCREEN_H) mouse_y = SCREEN_H - 1;
-            if (mouse_left && !drag_win && !resize_win) handle_click(mouse_x, mouse_y);
-            if (!mouse_left) { drag_win = NULL; resize_win = NULL; }
-            if (drag_win) { drag_win->x = mouse_x - drag_off_x; drag_win->y = mouse_y - drag_off_y; }
-            if (resize_win) { int nw = mouse_x - resize_win->x + 1; int nh = mouse_y - resize_win->y + 1; if(nw > 10) resize_win->w = nw; if(nh > 5) resize_win->h = nh; }
-            update_paint_tool();
-        }}
-    } else if (status & 0x01) {
-        uint8_t scancode = inb(0x60);
-        if (scancode == 0x2A || scancode == 0x36) shift_pressed = true;
-        else if (scancode == 0xAA || scancode == 0xB6) shift_pressed = false;
-        else if (!(scancode & 0x80)) { char c = shift_pressed ? kbd_map_shift[scancode] : kbd_map[scancode]; handle_key(c, scancode); }
-    }
-}
-
-void kernel_main(void) {
-    for(int i=0; i<1200; i++) paint_canvas[i] = 0xFF; 
-    for(int i=0; i<10; i++) ram_disk[i].used = false; 
-    
-    mouse_cycle = 0; uint32_t wait = 10000; while(wait--) asm volatile("nop");
-    outb(0x64, 0xA8); outb(0x64, 0x20); uint8_t status = inb(0x60) | 2; outb(0x64, 0x60); outb(0x60, status); outb(0x64, 0xD4); outb(0x60, 0xF4); inb(0x60);
-    
-    for(int i=0; i<100; i++) { render_boot(i); for(int d=0; d<12000000; d++) asm volatile("nop"); }
-    current_state = STATE_LOGIN;
-    while(1) { update_drivers(); update_snake(); render(); }
+    if(show_save_dialog || show_load_dialog) {
+        int dx=DIALOG_X, dy=DIALOG_Y; draw_rect(dx, dy, 30, 8, LIGHT_GREY, BLACK, ' '); draw_rect(dx, dy, 30, 1, BLUE, WHITE, ' ');
+        draw_text(dx+1, dy, show_load_dialog?"Open File...":"Save As...", BLUE, WHITE); draw_text(dx+2, dy+2, "Name:", LIGHT_GREY, BLACK);
+        draw_rect(dx+2, dy+3, 20, 1, WHITE, BLACK, ' '); draw_text(dx+2, dy+3, dialog_input_buf, WHITE, BLACK);
+        draw_rect(dx+2, dy+5, 6, 1, GREEN, BLACK, ' '); draw_text(dx+3, dy+5, " OK ", GREEN, BLACK);
+    }
+    if (prof_overlay) render_profiler();
+    if (rect_overlaps((Rect){ mouse_x, mouse_y, 1, 1 }, cpu_clip())) back_buffer[mouse_y*SCREEN_W+mouse_x] = vga_entry(0x1E, WHITE);
+}
+
+/* With more than one CPU each dirty rect is cut into horizontal bands that render as jobs, each
+ * clipped to its own rows of back_buffer. Whatever render_scene() would scroll or fault in is
+ * settled here first, and Paint's image is parsed once for all bands (a sector that fails to read
+ * stays out of RAM, and must not send every band to the disk), so the jobs only read shared state. Rects folded together by damage() can
+ * overlap; two bands then write the same values to the same cells, which is harmless. */
+#define RENDER_BAND_MIN 4 // rows: thinner bands cost more to hand out than they save
+Rect render_bands[DIRTY_MAX * MAX_CPUS];
+void render_band(void* arg) { cpu_set_clip(*(Rect*)arg); render_scene(); }
+void render_parallel() {
+    if (win_notepad.visible) np_follow_cursor(&win_notepad);
+    if (win_paint.visible) { paint_image(&render_paint_img); render_paint_ready = true; } // may read sectors in, under disk_lock
+    if (win_files.visible) explorer_settle(&win_files);
+    JobGroup g = { 0 }; int n = 0;
+    for (int i = 0; i < dirty_count; i++) {
+        Rect r = dirty_rects[i]; int bands = imax(1, imin(smp_workers, r.h / RENDER_BAND_MIN));
+        for (int b = 0; b < bands; b++) { int y0 = r.y + r.h * b / bands, y1 = r.y + r.h * (b + 1) / bands; render_bands[n++] = (Rect){ r.x, y0, r.w, y1 - y0 }; }
+    }
+    if (n == 1) render_band(&render_bands[0]); // a cursor blink or a single key: no job, no IPI
+    else { for (int i = 0; i < n; i++) job_submit(&g, render_band, &render_bands[i]); job_wait(&g); }
+    render_paint_ready = false;
+}
+void render() {
+    PROF_ZONE(PZ_FRAME); uint64_t t0 = rdtsc();
+    wm_update_vis();
+    if (smp_workers > 1) render_parallel();
+    else for (int i = 0; i < dirty_count; i++) { cpu_set_clip(dirty_rects[i]); render_scene(); }
+    cpu_set_clip((Rect){ 0, 0, SCREEN_W, SCREEN_H });
+    buffer_swap(); render_cycles += rdtsc() - t0;
+}
+
+void mouse_apply(int dx, int dy, uint8_t buttons) {
+    damage(mouse_x, mouse_y, 1, 1);
+    if (MOUSE_SPEED == 0) { mouse_x += dx/2; mouse_y -= dy/2; } else { mouse_x += dx; mouse_y -= dy; }
+    mouse_left = buttons & 1;
+    mouse_x = imax(0, imin(mouse_x, SCREEN_W - 1)); mouse_y = imax(0, imin(mouse_y, SCREEN_H - 1));
+    if (mouse_left && !drag_win && !resize_win) handle_click(mouse_x, mouse_y);
+    if (!mouse_left) { drag_win = NULL; resize_win = NULL; }
+    if (drag_win) { damage_window(drag_win); drag_win->x = mouse_x - drag_off_x; drag_win->y = mouse_y - drag_off_y; damage_window(drag_win); }
+    if (resize_win) { damage_window(resize_win); int nw = mouse_x - resize_win->x + 1; int nh = mouse_y - resize_win->y + 1; if(nw > 10) resize_win->w = nw; if(nh > 5) resize_win->h = nh; damage_window(resize_win); }
+    update_paint_tool();
+    damage(mouse_x, mouse_y, 1, 1);
+}
+
+Task* update_drivers() { // returns the app whose queue is too full to go on, with its events still in the ring
+    PROF_ZONE(PZ_INPUT);
+    while (!ev_empty()) {
+        Task* busy = app_backlog(); if (busy) return busy;
+        Event e = event_ring[ev_tail & (EVENT_RING_SIZE-1)]; barrier(); ev_tail++;
+        if (e.type == EV_KEY) { handle_key(e.c, e.code); continue; }
+        // Coalesce runs of pure motion: while no button is held, only the final position matters.
+        // Held-button packets are kept individually so drags and paint strokes see every sample.
+        int dx = e.dx, dy = e.dy;
+        while (!(e.buttons & 1) && !ev_empty()) {
+            Event* n = &event_ring[ev_tail & (EVENT_RING_SIZE-1)];
+            if (n->type != EV_MOUSE || n->buttons != e.buttons) break;
+            dx += n->dx; dy += n->dy; barrier(); ev_tail++;
+        }
+        mouse_apply(dx, dy, e.buttons);
+    }
+    return NULL;
+}
+
+/* Tasks. Input and timers are short and run at high priority so they always get in promptly;
+ * the compositor and the apps share the normal level; write-back to disk runs below them. */
+void input_main(void* arg) {
+    (void)arg;
+    while (1) {
+        cli(); while (ev_empty() || current_state == STATE_BOOT) task_block(WAIT_EVENT); sti(); // the IRQ wakes us, checked with IF=0 so no wake-up is lost; input waits for the login screen
+        mutex_lock(&gui_lock); Task* busy = update_drivers(); mutex_unlock(&gui_lock);
+        if (busy) msg_wait_room(busy, APP_MSG_ROOM); // the app needs gui_lock to drain its queue
+    }
+}
+void timers_main(void* arg) {
+    (void)arg;
+    while (1) {
+        cli(); while (!timers_due) task_block(WAIT_EVENT); timers_due = false; sti();
+        mutex_lock(&gui_lock); timer_run(); mutex_unlock(&gui_lock);
+    }
+}
+void wm_main(void* arg) {
+    (void)arg;
+    while (1) {
+        cli(); while (!dirty_count) task_block(WAIT_EVENT); sti();
+        mutex_lock(&gui_lock); if (dirty_count) render(); mutex_unlock(&gui_lock);
+    }
+}
+void app_main(void* arg) {
+    Window* w = arg;
+    while (1) { Msg m = msg_recv(); mutex_lock(&gui_lock); app_handle(w, m); mutex_unlock(&gui_lock); }
+}
+void sync_main(void* arg) { (void)arg; while (1) { msg_recv(); fs_sync(); } }
+void prof_main(void* arg) { (void)arg; while (1) { msg_recv(); prof_report(); trace_flush(); } } // the UART is slow, so this runs without gui_lock
+/* Replay. Starts once the login screen is up and hands the trace to the input task one event at
+ * a time. Running below everything else, it only gets the CPU back once the event has been
+ * handled and every app and the compositor have gone idle again. The run ends with
+ * "replay events=<n> frames=<n> ms=<t> frame_us=<t> fps=<n> checksum=<fnv1a>" on COM1; timer-driven
+ * content (Snake, uptime) is not part of what a trace pins down, so leave it off screen. */
+Timer replay_timer;
+void replay_wake(void* arg) { (void)arg; msg_send(replay_task, MSG_TICK, 0, 0); }
+void replay_settle() { while (!ev_empty() || dirty_count) task_yield(); }
+void replay_main(void* arg) {
+    (void)arg; msg_recv(); // boot_try_login()
+    uint32_t t0 = clock_ms, frames0 = frames_rendered, events = 0; uint64_t cycles0 = render_cycles; TraceRec r;
+    while (trace_next(&r)) {
+        if (!trace_fast && (int32_t)(t0 + r.ms - clock_ms) > 0) {
+            mutex_lock(&gui_lock); timer_start(&replay_timer, t0 + r.ms - clock_ms, 0, replay_wake, NULL); mutex_unlock(&gui_lock);
+            msg_recv();
+        }
+        uint32_t f = irq_save(); ev_push(r.e); task_wake(input_task); irq_restore(f); // stands in for the ISRs, which drop live input meanwhile
+        events++; replay_settle();
+    }
+    replay_settle();
+    uint32_t ms = clock_ms - t0, frames = frames_rendered - frames0; char line[128];
+    char* e = fmt_str(line, "replay events="); e = fmt_uint(e, events); e = fmt_str(e, " frames="); e = fmt_uint(e, frames); e = fmt_str(e, " ms="); e = fmt_uint(e, ms);
+    e = fmt_str(e, " frame_us="); e = fmt_uint(e, frames ? tsc_to_us((render_cycles - cycles0) / frames) : 0); e = fmt_str(e, " fps="); e = fmt_uint(e, ms ? frames * 1000 / ms : 0);
+    e = fmt_str(e, " checksum="); e = fmt_hex(e, screen_checksum()); fmt_str(e, "\n"); serial_write(line);
+    if (cmdline_has("replayquit")) { mutex_lock(&gui_lock); sys_shutdown(); }
+}
+void sched_start() {
+    input_task = task_create("input", PRIO_HIGH, input_main, NULL);
+    sys_task = task_create("timers", PRIO_HIGH, timers_main, NULL);
+    wm_task = task_create("wm", PRIO_NORMAL, wm_main, NULL);
+    for (int i = 0; i < WIN_COUNT; i++) app_tasks[windows[i]->id] = task_create(windows[i]->title, PRIO_NORMAL, app_main, windows[i]);
+    sync_task = task_create("sync", PRIO_LOW, sync_main, NULL);
+    prof_task = task_create("prof", PRIO_LOW, prof_main, NULL);
+    if (trace_mode == TRACE_REPLAY) replay_task = task_create("replay", PRIO_LOW, replay_main, NULL);
+    task_create("storage", PRIO_NORMAL, storage_main, NULL);
+    sched_running = true; task_yield();
+}
+
+/* "smpbench" on the command line: before the scheduler starts, time full-screen frames of the
+ * desktop with every window open on 1, 2, ... CPUs and log one line per count over COM1:
+ * "smp workers=<n> frame_us=<t> speedup=<x100>". */
+#define SMP_BENCH_FRAMES 200
+void smp_bench() {
+    current_state = STATE_DESKTOP; for (int i = 0; i < WIN_COUNT; i++) wm_open(windows[i]);
+    uint32_t base = 0; char line[80];
+    for (uint32_t n = 1; n <= cpu_count; n++) {
+        smp_workers = n; uint64_t t0 = rdtsc();
+        for (int f = 0; f < SMP_BENCH_FRAMES; f++) { damage_all(); render(); }
+        uint32_t us = tsc_to_us((rdtsc() - t0) / SMP_BENCH_FRAMES); if (n == 1) base = us;
+        char* e = fmt_str(line, "smp workers="); e = fmt_uint(e, n); e = fmt_str(e, " frame_us="); e = fmt_uint(e, us);
+        e = fmt_str(e, " speedup="); e = fmt_uint(e, us ? base * 100 / us : 0); fmt_str(e, "\n"); serial_write(line);
+    }
+    smp_workers = cpu_count; current_state = STATE_BOOT; start_open = false;
+    for (int i = 0; i < WIN_COUNT; i++) windows[i]->visible = false;
+    damage_all();
+}
+
+void kernel_main(uint32_t magic, uint32_t mb_info) {
+    boot_tsc0 = rdtsc(); cpu_init(0); cpu_load(&cpus[0]); serial_init(); tsc_calibrate();
+    cmdline_init(magic, (const MultibootInfo*)(uintptr_t)mb_info); fast_boot = cmdline_has("fastboot");
+    boot_stage("tsc");
+    pmm_init(magic, (const MultibootInfo*)(uintptr_t)mb_info); trace_init(magic, (const MultibootInfo*)(uintptr_t)mb_info); boot_stage("memory");
+    if (cmdline_has("gfx")) vbe_init(); // stays in text mode if there is no VBE adapter
+    gfx_init(); np_init(); paint_new(IMG_LEGACY_W, IMG_LEGACY_H); fs_init(); boot_stage("video");
+    ps2_init(); boot_stage(kbd_state != DEV_READY ? "ps2 absent" : mouse_state == DEV_READY ? "ps2" : "ps2 no mouse");
+    smp_init(); idt_init(); pit_init(); irq_unmask(0); irq_unmask(1); irq_unmask(12); ps2_flush(); sti(); // drop anything left over from the handshake: a full buffer raises no new edge
+    smp_start(); boot_stage(cpu_count > 1 ? "smp" : "smp single cpu");
+    if (cmdline_has("smpbench")) smp_bench();
+    if (trace_mode == TRACE_REPLAY && !trace_src) { trace_load_serial(); boot_stage("trace"); }
+    timer_start(&boot_timer, 0, fast_boot ? FAST_BOOT_POLL_MS : BOOT_FRAME_MS, boot_step, NULL); // storage comes up in its own task, see sched_start()
+    timer_start(&clock_timer, 1000, 1000, clock_step, NULL);
+    timer_start(&sync_timer, SYNC_MS, SYNC_MS, sync_step, NULL);
+    sched_start();
+    while (1) asm volatile("sti; hlt" ::: "memory"); // idle task: runs only when nothing else can
 }
\ No newline at end of file
@@ -0,0 +1,91 @@
+/* Scripted input traces for "replay" ("make traces"). kernel.c is compiled in with HOSTED defined,
+ * so the scripts click where the windows, menus and tool bars really are. A trace is written to
+ * stdout in the format section 5d records, starting with the login and ending with "trace end":
+ *   tracegen <open_all|type_10k|paint> [gfx]
+ * "gfx" lays the screen out as the framebuffer mode does. In text mode every event is also played
+ * on the hosted kernel as it is written, and the frame it leaves on screen is checked against a
+ * full repaint: any cell that differs is damage the input path forgot, and fails the run. */
+#include <stdio.h>
+#include "kernel.c"
+
+extern const uint32_t hosted_ram_size; // hosted.c
+
+#define KEY_MS 10   // between key presses
+#define MOVE_MS 8   // between mouse packets
+#define MOVE_MAX 100 // largest step per packet, well inside the 9-bit packet range
+
+uint32_t t = 0; int gx, gy; // trace clock, and where the pointer is by now
+bool check = false; uint32_t stale_events = 0;
+uint16_t full_frame[TEXT_W * TEXT_H]; // the incremental frame
+
+void play(Event e) { // incremental frame first, then compare it with a full repaint
+    if (!check) return;
+    ev_push(e); update_drivers(); render();
+    for (int o = 0; o < SCREEN_W * SCREEN_H; o++) full_frame[o] = front_buffer[o];
+    damage_all(); render();
+    int stale = 0; for (int o = 0; o < SCREEN_W * SCREEN_H; o++) stale += full_frame[o] != front_buffer[o];
+    if (stale && !stale_events++) fprintf(stderr, "tracegen: %d stale cells after the event at %u ms\n", stale, t);
+}
+void key(uint8_t code, char c) { printf("trace %u k %u %u\n", t, code, (uint8_t)c); play((Event){ EV_KEY, code, c, 0, 0, 0 }); t += KEY_MS; }
+void type(const char* s) {
+    for (; *s; s++) {
+        int code = 0; while (code < 128 && kbd_map[code] != *s && kbd_map_shift[code] != *s) code++;
+        if (code < 128) key(code, *s);
+    }
+}
+void packet(int buttons, int dx, int dy) { printf("trace %u m %d %d %d\n", t, buttons, dx, dy); play((Event){ EV_MOUSE, 0, 0, (uint8_t)buttons, (int16_t)dx, (int16_t)dy }); t += MOVE_MS; }
+void home() { packet(0, -255, 255); gx = gy = 0; } // mouse_apply() clamps to the top left corner
+void move_to(int x, int y, int buttons) { // packets count y upwards
+    while (gx != x || gy != y) { int dx = imax(-MOVE_MAX, imin(MOVE_MAX, x - gx)), dy = imax(-MOVE_MAX, imin(MOVE_MAX, y - gy)); packet(buttons, dx, -dy); gx += dx; gy += dy; }
+}
+void click(int x, int y) { move_to(x, y, 0); packet(1, 0, 0); packet(0, 0, 0); }
+void drag(int x0, int y0, int x1, int y1) { // one cell per packet so every cell on the way is seen
+    move_to(x0, y0, 0); packet(1, 0, 0);
+    while (gx != x1 || gy != y1) move_to(gx + (x1 > gx) - (x1 < gx), gy + (y1 > gy) - (y1 < gy), 1);
+    packet(0, 0, 0);
+}
+
+void login() { type(USERNAME); key(0x0F, '\t'); type(PASSWORD); key(0x1C, '\n'); home(); }
+void start_menu(int item) { click(1, SCREEN_H - 1); click(2, SCREEN_H - 14 + item); } // items as in handle_click()
+
+// Every app from the Start menu. Snake, the top one, is then closed, reopened and closed for good:
+// its timer would make the final screen vary.
+void open_all() {
+    for (int item = 3; item <= 8; item++) start_menu(item);
+    click(win_snake.x + win_snake.w - 1, win_snake.y); start_menu(8); click(win_snake.x + win_snake.w - 1, win_snake.y);
+}
+void type_10k() {
+    const char* words = "the quick brown fox jumps over the lazy dog 0123456789 ";
+    start_menu(3); char line[61];
+    for (int n = 0, w = 0; n < 10 * 1024; n += 61) {
+        for (int i = 0; i < 60; i++) line[i] = words[w++ % strlen(words)];
+        line[60] = 0; type(line); key(0x1C, '\n');
+    }
+}
+void paint() { // the largest window size from Edit, then a stroke along every other canvas row, each in the next palette colour
+    start_menu(5); Window* w = &win_paint;
+    click(w->x + 9, w->y + 2); click(w->x + 2, w->y + 6);
+    for (int ry = 3, n = 0; ry < w->h - 1; ry += 2, n++) {
+        click(w->x + 14 + 2 * (1 + n % 8), w->y + 2);
+        drag(w->x + 1, w->y + ry, w->x + w->w - 2, w->y + ry);
+    }
+}
+
+int main(int argc, char** argv) {
+    if (argc < 2) { fprintf(stderr, "usage: tracegen <open_all|type_10k|paint> [gfx]\n"); return 1; }
+    if (argc > 2 && streq(argv[2], "gfx")) { SCREEN_W = GFX_W / GLYPH_W; SCREEN_H = GFX_H / GLYPH_H; }
+    else { // boot the hosted kernel to its login screen, as bench.c does
+        MultibootInfo mb = { .flags = 1, .mem_upper = hosted_ram_size / 1024 };
+        pmm_base = (uintptr_t)kernel_end - 0x100000; pmm_init(MULTIBOOT_MAGIC, &mb);
+        gfx_init(); np_init(); paint_new(IMG_LEGACY_W, IMG_LEGACY_H); fs_init();
+        current_state = STATE_LOGIN; damage_all(); render(); check = true;
+    }
+    login();
+    if (streq(argv[1], "open_all")) open_all();
+    else if (streq(argv[1], "type_10k")) type_10k();
+    else if (streq(argv[1], "paint")) paint();
+    else { fprintf(stderr, "tracegen: unknown workload %s\n", argv[1]); return 1; }
+    printf("trace end\n");
+    if (stale_events) fprintf(stderr, "tracegen: %u events left stale cells\n", stale_events);
+    return stale_events != 0;
+}